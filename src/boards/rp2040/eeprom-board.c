@@ -8,6 +8,7 @@
 #include <string.h>
 
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
 #include "hardware/flash.h"
 
 #include "utilities.h"
@@ -42,10 +43,23 @@ uint8_t EepromMcuFlush()
 {
     uint32_t mask;
 
+    // The session is flushed while the application runs, so park the other core
+    // in RAM if it has agreed to be, it can't run from flash during the erase
+    bool lockout = multicore_lockout_victim_is_initialized(get_core_num() ^ 1);
+    if (lockout) {
+        multicore_lockout_start_blocking();
+    }
+
     BoardCriticalSectionBegin(&mask);
 
     flash_range_erase(EEPROM_OFFSET, sizeof(eeprom_write_cache));
     flash_range_program(EEPROM_OFFSET, eeprom_write_cache, sizeof(eeprom_write_cache));
 
     BoardCriticalSectionEnd(&mask);
+
+    if (lockout) {
+        multicore_lockout_end_blocking();
+    }
+
+    return LMN_STATUS_OK;
 }
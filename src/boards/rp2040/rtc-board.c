@@ -13,6 +13,7 @@
 static alarm_pool_t* rtc_alarm_pool = NULL;
 static absolute_time_t rtc_timer_context;
 static alarm_id_t last_rtc_alarm_id = -1;
+static uint32_t rtc_backup_data[2] = { 0, 0 }; // SysTime offset from the calendar time
 
 void RtcInit( void )
 {
@@ -32,8 +33,8 @@ uint32_t RtcGetCalendarTime( uint16_t *milliseconds )
 
 void RtcBkupRead( uint32_t *data0, uint32_t *data1 )
 {
-    *data0 = 0;
-    *data1 = 0;
+    *data0 = rtc_backup_data[0];
+    *data1 = rtc_backup_data[1];
 }
 
 uint32_t RtcGetTimerElapsedTime( void )
@@ -105,6 +106,8 @@ TimerTime_t RtcTick2Ms( uint32_t tick )
 
 void RtcBkupWrite( uint32_t data0, uint32_t data1 )
 {
+    rtc_backup_data[0] = data0;
+    rtc_backup_data[1] = data1;
 }
 
 void RtcProcess( void )
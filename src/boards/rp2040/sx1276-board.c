@@ -94,8 +94,24 @@ uint32_t SX1276GetDio1PinState( void )
     return GpioRead(&SX1276.DIO1);
 }
 
+/*!
+ * Radio transmissions since boot, the MAC's retransmissions included
+ */
+static volatile uint32_t TxCount = 0;
+
+uint32_t SX1276GetTxCount( void )
+{
+    return TxCount;
+}
+
 void SX1276SetAntSw( uint8_t opMode )
 {
+    // There's no antenna switch to drive, but every transmission starts with a
+    // switch to TX mode, so this is where they're counted
+    if( opMode == RF_OPMODE_TRANSMITTER )
+    {
+        TxCount++;
+    }
 }
 
 void SX1276Reset( void )
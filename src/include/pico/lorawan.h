@@ -44,6 +44,92 @@ struct lorawan_otaa_settings {
     const char* channel_mask;
 };
 
+// Same as the settings above with the hex strings already turned into bytes, most
+// significant byte first. NULL fields are treated the same way
+struct lorawan_abp_binary_settings {
+    const uint8_t* device_address;          // 4 bytes
+    const uint8_t* network_session_key;     // 16 bytes
+    const uint8_t* app_session_key;         // 16 bytes
+    const uint16_t* channel_mask;           // 6 words
+};
+
+struct lorawan_otaa_binary_settings {
+    const uint8_t* device_eui;              // 8 bytes
+    const uint8_t* app_eui;                 // 8 bytes
+    const uint8_t* app_key;                 // 16 bytes
+    const uint16_t* channel_mask;           // 6 words
+};
+
+// Turn a hex string literal into an initializer for a byte (or channel mask word)
+// array at compile time, e.g.
+//   static const uint8_t app_key[] = LORAWAN_HEX_16("000102030405060708090A0B0C0D0E0F");
+// Anything but a string literal of the right length, NULL included, fails the
+// static assertion in LORAWAN_HEX_CHECK. Leave an optional setting undefined
+// instead of setting it to NULL.
+//
+// These are C only, and rely on GCC and Clang folding subscripted string literals
+// into constants in static initializers, which ISO C doesn't require. Other
+// toolchains can pass the hex strings to lorawan_init_abp() or lorawan_init_otaa()
+// instead, which parse them at run time.
+#define LORAWAN_HEX_NIBBLE(c)           ((c) <= '9' ? (c) - '0' : ((c) | 0x20) - 'a' + 10)
+#define LORAWAN_HEX_BYTE(s, i)          ((uint8_t) ((LORAWAN_HEX_NIBBLE((s)[2 * (i)]) << 4) | LORAWAN_HEX_NIBBLE((s)[2 * (i) + 1])))
+#define LORAWAN_HEX_WORD(s, i)          ((uint16_t) ((LORAWAN_HEX_BYTE(s, 2 * (i)) << 8) | LORAWAN_HEX_BYTE(s, 2 * (i) + 1)))
+#define LORAWAN_HEX_CHECK(s, n)         (0 * sizeof(struct { _Static_assert(sizeof(s) == 2 * (n) + 1, \
+                                            "expected a hex string literal of the right length, not NULL"); char c; }))
+
+#define LORAWAN_HEX_4(s)                { (uint8_t) (LORAWAN_HEX_CHECK(s, 4) + LORAWAN_HEX_BYTE(s, 0)), \
+                                          LORAWAN_HEX_BYTE(s, 1), LORAWAN_HEX_BYTE(s, 2), LORAWAN_HEX_BYTE(s, 3) }
+#define LORAWAN_HEX_8(s)                { (uint8_t) (LORAWAN_HEX_CHECK(s, 8) + LORAWAN_HEX_BYTE(s, 0)), \
+                                          LORAWAN_HEX_BYTE(s, 1), LORAWAN_HEX_BYTE(s, 2), LORAWAN_HEX_BYTE(s, 3), \
+                                          LORAWAN_HEX_BYTE(s, 4), LORAWAN_HEX_BYTE(s, 5), LORAWAN_HEX_BYTE(s, 6), \
+                                          LORAWAN_HEX_BYTE(s, 7) }
+#define LORAWAN_HEX_16(s)               { (uint8_t) (LORAWAN_HEX_CHECK(s, 16) + LORAWAN_HEX_BYTE(s, 0)), \
+                                          LORAWAN_HEX_BYTE(s, 1), LORAWAN_HEX_BYTE(s, 2), LORAWAN_HEX_BYTE(s, 3), \
+                                          LORAWAN_HEX_BYTE(s, 4), LORAWAN_HEX_BYTE(s, 5), LORAWAN_HEX_BYTE(s, 6), \
+                                          LORAWAN_HEX_BYTE(s, 7), LORAWAN_HEX_BYTE(s, 8), LORAWAN_HEX_BYTE(s, 9), \
+                                          LORAWAN_HEX_BYTE(s, 10), LORAWAN_HEX_BYTE(s, 11), LORAWAN_HEX_BYTE(s, 12), \
+                                          LORAWAN_HEX_BYTE(s, 13), LORAWAN_HEX_BYTE(s, 14), LORAWAN_HEX_BYTE(s, 15) }
+#define LORAWAN_HEX_CHANNEL_MASK(s)     { (uint16_t) (LORAWAN_HEX_CHECK(s, 12) + LORAWAN_HEX_WORD(s, 0)), \
+                                          LORAWAN_HEX_WORD(s, 1), LORAWAN_HEX_WORD(s, 2), LORAWAN_HEX_WORD(s, 3), \
+                                          LORAWAN_HEX_WORD(s, 4), LORAWAN_HEX_WORD(s, 5) }
+
+struct lorawan_rx_info {
+    uint8_t app_port;
+    int16_t rssi;           // dBm
+    int8_t snr;             // dB
+    int8_t rx_slot;         // LoRaMacRxSlot_t, e.g. RX_SLOT_WIN_1
+    int8_t datarate;
+    uint32_t downlink_counter;
+    uint8_t dropped;        // frames lost to a full receive queue just before this one
+};
+
+#define LORAWAN_SEND_CONFIRMED      0x01    // ask the network to ack the uplink at the MAC layer
+
+#define LORAWAN_TX_OK               0       // the uplink went out, and was acked if confirmed and ack_received is set
+#define LORAWAN_TX_ERROR            -1      // the MAC failed to send the uplink, see mac_status
+#define LORAWAN_TX_PAYLOAD_DROPPED  -2      // no room next to pending MAC commands, only the MAC commands went out
+
+struct lorawan_tx_status {
+    int result;             // LORAWAN_TX_*
+    uint8_t mac_status;     // LoRaMacEventInfoStatus_t
+    uint8_t app_port;
+    bool confirmed;
+    bool ack_received;
+    int8_t datarate;
+    int8_t tx_power;        // TX_POWER_* index
+    uint8_t channel;
+    uint32_t uplink_counter;
+    uint32_t time_on_air_ms;
+    uint8_t nb_trans;       // times the frame went out, retransmissions included
+};
+
+typedef void (*lorawan_tx_callback_t)(const struct lorawan_tx_status* status, void* context);
+
+// Checked by lorawan_process_timeout_ms_until() every time the core wakes up,
+// returns true to end the wait early, e.g. once another core or an IRQ has
+// queued work and sent an event with __sev()
+typedef bool (*lorawan_wake_callback_t)(void* context);
+
 const char* lorawan_default_dev_eui(char* dev_eui);
 
 int lorawan_init(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region);
@@ -52,6 +138,10 @@ int lorawan_init_abp(const struct lorawan_sx1276_settings* sx1276_settings, LoRa
 
 int lorawan_init_otaa(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region, const struct lorawan_otaa_settings* otaa_settings);
 
+int lorawan_init_abp_binary(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region, const struct lorawan_abp_binary_settings* abp_settings);
+
+int lorawan_init_otaa_binary(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region, const struct lorawan_otaa_binary_settings* otaa_settings);
+
 int lorawan_join();
 
 int lorawan_is_joined();
@@ -60,10 +150,40 @@ int lorawan_process();
 
 int lorawan_process_timeout_ms(uint32_t timeout_ms);
 
+int lorawan_process_timeout_ms_until(uint32_t timeout_ms, lorawan_wake_callback_t wake, void* context);
+
 int lorawan_send_unconfirmed(const void* data, uint8_t data_len, uint8_t app_port);
 
+int lorawan_send_confirmed(const void* data, uint8_t data_len, uint8_t app_port, lorawan_tx_callback_t callback, void* context);
+
+int lorawan_send_async(const void* data, uint8_t data_len, uint8_t app_port, uint8_t flags, lorawan_tx_callback_t callback, void* context);
+
+uint8_t* lorawan_tx_reserve(uint8_t data_len);
+
+int lorawan_tx_commit(uint8_t data_len, uint8_t app_port, uint8_t flags, lorawan_tx_callback_t callback, void* context);
+
+int lorawan_is_tx_pending();
+
+int lorawan_is_busy();
+
+int lorawan_max_payload_size();
+
+int lorawan_duty_cycle_wait_ms();
+
+int lorawan_time_on_air_ms(uint8_t data_len);
+
 int lorawan_receive(void* data, uint8_t data_len, uint8_t* app_port);
 
+int lorawan_receive_info(void* data, uint8_t data_len, struct lorawan_rx_info* info);
+
+int lorawan_receive_pending();
+
+uint32_t lorawan_downlink_count();
+
+int lorawan_request_time();
+
+int lorawan_receive_time(uint32_t* seconds, uint16_t* milliseconds);
+
 void lorawan_debug(bool debug);
 
 int lorawan_erase_nvm();
@@ -166,22 +166,131 @@ static volatile uint8_t IsMacProcessPending = 0;
 
 static volatile uint32_t TxPeriodicity = 0;
 
-static const struct lorawan_abp_settings* AbpSettings = NULL;
+static const struct lorawan_abp_binary_settings* AbpSettings = NULL;
 
-static const struct lorawan_otaa_settings* OtaaSettings = NULL;
+static const struct lorawan_otaa_binary_settings* OtaaSettings = NULL;
 
-static uint8_t AppRxDataBuffer[LORAWAN_APP_DATA_BUFFER_MAX_SIZE];
+/*!
+ * Credentials given as hex strings are turned into bytes once, by
+ * lorawan_init_abp() or lorawan_init_otaa(), and kept here
+ */
+static uint8_t ParsedDeviceAddress[4];
+static uint8_t ParsedEui[2][8];
+static uint8_t ParsedKey[2][16];
+static uint16_t ParsedChannelMask[6];
+
+static struct lorawan_abp_binary_settings ParsedAbpSettings;
+static struct lorawan_otaa_binary_settings ParsedOtaaSettings;
+
+/*!
+ * Received downlinks waiting for lorawan_receive(). A Class C burst, multicast
+ * or the server flushing its queue after FPending can deliver several frames
+ * before the application gets to them, so each one gets a slot of its own
+ */
+#ifndef LORAWAN_RX_QUEUE_DEPTH
+#define LORAWAN_RX_QUEUE_DEPTH                      4
+#endif
 
-static LmHandlerAppData_t AppRxData =
+typedef struct RxQueueEntry_s
 {
-    .Buffer = AppRxDataBuffer,
-    .BufferSize = 0,
-    .Port = 0,
-};
+    struct lorawan_rx_info Info;
+    uint8_t BufferSize;
+    uint8_t Buffer[LORAWAN_APP_DATA_BUFFER_MAX_SIZE];
+}RxQueueEntry_t;
+
+static RxQueueEntry_t RxQueue[LORAWAN_RX_QUEUE_DEPTH];
+static uint8_t RxQueueHead = 0;
+static uint8_t RxQueueCount = 0;
+
+/*!
+ * Frames dropped because RxQueue was full, reported with the next frame that
+ * makes it in
+ */
+static uint8_t RxQueueDropped = 0;
+
+/*!
+ * Downlink frames received since boot, including the ones that only
+ * carried MAC commands or an ack and never make it into RxQueue
+ */
+static uint32_t DownlinkCount = 0;
+
+/*!
+ * Indicates that an uplink has been handed to the MAC and that its
+ * McpsConfirm, which follows the closing of the RX windows, hasn't arrived yet
+ */
+static volatile bool IsTxPending = false;
+
+/*!
+ * Completion callback for the uplink in flight, see lorawan_send_async()
+ */
+static lorawan_tx_callback_t TxCallback = NULL;
+static void* TxCallbackContext = NULL;
+
+/*!
+ * Indicates that the MAC had no room for the application payload of the last
+ * send and sent an empty frame to flush its pending MAC commands instead
+ */
+static bool IsTxPayloadFlushed = false;
+
+/*!
+ * Bytes of AppDataBuffer handed out by lorawan_tx_reserve(). The packages only
+ * write their answers into AppDataBuffer from lorawan_process(), and the MAC
+ * copies the payload into its own frame buffer when the uplink is requested, so
+ * the buffer is ours from lorawan_tx_reserve() until lorawan_tx_commit() returns
+ */
+static uint8_t TxReserveSize = 0;
+
+/*!
+ * Radio transmission count when the uplink in flight was handed to the MAC.
+ * LmHandler doesn't pass McpsConfirm's NbTrans on, so the radio's count is the
+ * only way to tell how many times the frame went out
+ */
+static uint32_t TxCountAtSend = 0;
+
+/*!
+ * Indicates that a DeviceTimeAns has set the system time since the last
+ * lorawan_receive_time() call
+ */
+static volatile bool IsTimeUpdatePending = false;
+
+/*!
+ * DeviceTimeAns carries GPS time, which the MAC moves to the Unix epoch without
+ * removing the leap seconds that UTC has accumulated since 1980
+ */
+#define GPS_UTC_LEAP_SECONDS 18
+
+/*!
+ * When the MAC last answered a request, which is when the duty cycle wait that
+ * LmHandlerGetDutyCycleWaitTime() reports started
+ */
+static TimerTime_t DutyCycleWaitStartTime = 0;
+
+/*!
+ * MHDR, FHDR without FOpts, FPort and MIC
+ */
+#define LORAWAN_FRAME_OVERHEAD 13
+
+/*!
+ * NVM stores between flash writes. Every uplink moves the frame counter, so
+ * writing the session out each time would wear out its flash sector in months.
+ * A restored session skips this many frame counts to make up for the ones that
+ * weren't written
+ */
+#define NVM_FLUSH_INTERVAL 16
+
+static int NvmStoresSinceFlush = 0;
+
+/*!
+ * Indicates that the next NVM store must be written out right away, set by a
+ * join since the DevNonce must never be reused, and by a restored session since
+ * its frame count skip must never be reused either
+ */
+static bool IsNvmFlushPending = false;
 
 static bool Debug = false;
 
 extern void EepromMcuInit();
+extern uint32_t SX1276GetTxCount( void );
 extern uint8_t EepromMcuFlush();
 
 const char* lorawan_default_dev_eui(char* dev_eui)
@@ -239,10 +348,118 @@ int lorawan_init(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacR
     // initialized and activated.
     LmHandlerPackageRegister( PACKAGE_ID_COMPLIANCE, &LmhpComplianceParams );
 
+    // LmHandlerInit() restored the session from NVM if every part of it passed its
+    // CRC check. Skip the frame counts that may have been used since it was last
+    // written so that the network server doesn't drop our uplinks as replays.
+    // The skip only lives in RAM until the first uplink stores the context, so
+    // write that store out right away, otherwise a reset before the next regular
+    // flush would restore the old count and hand out the same frame counts again
+    if (lorawan_is_joined()) {
+        MibRequestConfirm_t mibReq;
+
+        mibReq.Type = MIB_NVM_CTXS;
+        LoRaMacMibGetRequestConfirm(&mibReq);
+        mibReq.Param.Contexts->Crypto.FCntList.FCntUp += NVM_FLUSH_INTERVAL;
+        IsNvmFlushPending = true;
+    }
+
     return 0;
 }
 
+/*!
+ * Turns length bytes' worth of hex digits into bytes. Returns false if hex
+ * is too short or holds anything but hex digits
+ */
+static bool ParseHex(const char* hex, uint8_t* bytes, int length)
+{
+    for (int i = 0; i < length * 2; i++) {
+        char c = hex[i];
+        uint8_t nibble;
+
+        if (c >= '0' && c <= '9') {
+            nibble = c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            nibble = (c | 0x20) - 'a' + 10;
+        } else {
+            return false;
+        }
+
+        bytes[i / 2] = (i % 2) ? (bytes[i / 2] | nibble) : (nibble << 4);
+    }
+
+    return true;
+}
+
+/*!
+ * Parses hex into bytes unless it's NULL. Sets *parsed to bytes, or to NULL
+ * along with hex, and returns false if hex isn't valid
+ */
+static bool ParseHexSetting(const char* hex, uint8_t* bytes, int length, const uint8_t** parsed)
+{
+    *parsed = NULL;
+
+    if (hex == NULL) {
+        return true;
+    }
+
+    if (!ParseHex(hex, bytes, length)) {
+        return false;
+    }
+
+    *parsed = bytes;
+
+    return true;
+}
+
+static bool ParseChannelMask(const char* hex, const uint16_t** parsed)
+{
+    uint8_t bytes[sizeof(ParsedChannelMask)];
+    const uint8_t* parsedBytes;
+
+    if (!ParseHexSetting(hex, bytes, sizeof(bytes), &parsedBytes)) {
+        return false;
+    }
+
+    *parsed = NULL;
+    if (parsedBytes != NULL) {
+        for (int i = 0; i < 6; i++) {
+            ParsedChannelMask[i] = (bytes[i * 2] << 8) | bytes[i * 2 + 1];
+        }
+        *parsed = ParsedChannelMask;
+    }
+
+    return true;
+}
+
 int lorawan_init_abp(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region, const struct lorawan_abp_settings* abp_settings)
+{
+    struct lorawan_abp_binary_settings* settings = &ParsedAbpSettings;
+
+    if (!ParseHexSetting(abp_settings->device_address, ParsedDeviceAddress, 4, &settings->device_address) ||
+        !ParseHexSetting(abp_settings->network_session_key, ParsedKey[0], 16, &settings->network_session_key) ||
+        !ParseHexSetting(abp_settings->app_session_key, ParsedKey[1], 16, &settings->app_session_key) ||
+        !ParseChannelMask(abp_settings->channel_mask, &settings->channel_mask)) {
+        return -1;
+    }
+
+    return lorawan_init_abp_binary(sx1276_settings, region, settings);
+}
+
+int lorawan_init_otaa(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region, const struct lorawan_otaa_settings* otaa_settings)
+{
+    struct lorawan_otaa_binary_settings* settings = &ParsedOtaaSettings;
+
+    if (!ParseHexSetting(otaa_settings->device_eui, ParsedEui[0], 8, &settings->device_eui) ||
+        !ParseHexSetting(otaa_settings->app_eui, ParsedEui[1], 8, &settings->app_eui) ||
+        !ParseHexSetting(otaa_settings->app_key, ParsedKey[0], 16, &settings->app_key) ||
+        !ParseChannelMask(otaa_settings->channel_mask, &settings->channel_mask)) {
+        return -1;
+    }
+
+    return lorawan_init_otaa_binary(sx1276_settings, region, settings);
+}
+
+int lorawan_init_abp_binary(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region, const struct lorawan_abp_binary_settings* abp_settings)
 {
     AbpSettings = abp_settings;
     OtaaSettings = NULL;
@@ -250,7 +467,7 @@ int lorawan_init_abp(const struct lorawan_sx1276_settings* sx1276_settings, LoRa
     return lorawan_init(sx1276_settings, region);
 }
 
-int lorawan_init_otaa(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region, const struct lorawan_otaa_settings* otaa_settings)
+int lorawan_init_otaa_binary(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region, const struct lorawan_otaa_binary_settings* otaa_settings)
 {
     AbpSettings = NULL;
     OtaaSettings = otaa_settings;
@@ -294,18 +511,29 @@ int lorawan_process()
 }
 
 int lorawan_process_timeout_ms(uint32_t timeout_ms)
+{
+    return lorawan_process_timeout_ms_until(timeout_ms, NULL, NULL);
+}
+
+int lorawan_process_timeout_ms_until(uint32_t timeout_ms, lorawan_wake_callback_t wake, void* context)
 {
     absolute_time_t timeout_time = make_timeout_time_ms(timeout_ms);
 
     bool joined = lorawan_is_joined();
+    bool tx_pending = IsTxPending;
     
     do {
         lorawan_process();
 
-        if (AppRxData.Port) {
+        if (RxQueueCount) {
             return 0;
         } else if (joined != lorawan_is_joined()) {
             return 0;
+        } else if (tx_pending && !IsTxPending) {
+            return 0;
+        } else if (wake != NULL && wake(context)) {
+            // Whatever woke us up with __sev() has work for the caller
+            return 0;
         }
     } while (!best_effort_wfe_or_timeout(timeout_time));
     
@@ -313,40 +541,196 @@ int lorawan_process_timeout_ms(uint32_t timeout_ms)
 }
 
 int lorawan_send_unconfirmed(const void* data, uint8_t data_len, uint8_t app_port)
+{
+    return lorawan_send_async(data, data_len, app_port, 0, NULL, NULL);
+}
+
+int lorawan_send_confirmed(const void* data, uint8_t data_len, uint8_t app_port, lorawan_tx_callback_t callback, void* context)
+{
+    return lorawan_send_async(data, data_len, app_port, LORAWAN_SEND_CONFIRMED, callback, context);
+}
+
+int lorawan_send_async(const void* data, uint8_t data_len, uint8_t app_port, uint8_t flags, lorawan_tx_callback_t callback, void* context)
 {
     LmHandlerAppData_t appData;
+    LmHandlerMsgTypes_t msgType = (flags & LORAWAN_SEND_CONFIRMED) ? LORAMAC_HANDLER_CONFIRMED_MSG : LORAMAC_HANDLER_UNCONFIRMED_MSG;
 
     appData.Port = app_port;
     appData.BufferSize = data_len;
     appData.Buffer = (uint8_t*)data;
 
+    IsTxPayloadFlushed = false;
+    TxCountAtSend = SX1276GetTxCount();
+
+    if (LmHandlerSend(&appData, msgType) != LORAMAC_HANDLER_SUCCESS) {
+        return -1;
+    }
+
+    IsTxPending = true;
+    TxCallback = callback;
+    TxCallbackContext = context;
+
+    return 0;
+}
+
+uint8_t* lorawan_tx_reserve(uint8_t data_len)
+{
+    if (data_len > sizeof(AppDataBuffer)) {
+        return NULL;
+    }
+
+    TxReserveSize = data_len;
+
+    return AppDataBuffer;
+}
+
+int lorawan_tx_commit(uint8_t data_len, uint8_t app_port, uint8_t flags, lorawan_tx_callback_t callback, void* context)
+{
+    uint8_t reserved = TxReserveSize;
+
+    TxReserveSize = 0;
+
+    if (data_len > reserved) {
+        return -1;
+    }
+
+    return lorawan_send_async(AppDataBuffer, data_len, app_port, flags, callback, context);
+}
+
+int lorawan_is_tx_pending()
+{
+    return IsTxPending;
+}
+
+int lorawan_is_busy()
+{
+    return LoRaMacIsBusy();
+}
+
+int lorawan_max_payload_size()
+{
+    LoRaMacTxInfo_t txInfo;
+    LoRaMacStatus_t status = LoRaMacQueryTxPossible(0, &txInfo);
+
+    // A length error still fills in txInfo, it means that the pending MAC
+    // commands leave no room for application data
+    if (status != LORAMAC_STATUS_OK && status != LORAMAC_STATUS_LENGTH_ERROR) {
+        return -1;
+    }
+
+    return txInfo.MaxPossibleApplicationDataSize;
+}
+
+int lorawan_duty_cycle_wait_ms()
+{
+    TimerTime_t waitTime = LmHandlerGetDutyCycleWaitTime();
+    TimerTime_t elapsedTime = TimerGetElapsedTime(DutyCycleWaitStartTime);
+
+    if (waitTime <= elapsedTime) {
+        return 0;
+    }
+
+    return waitTime - elapsedTime;
+}
+
+static int TimeOnAirMs(int8_t datarate, uint8_t data_len)
+{
+    GetPhyParams_t getPhy;
+
+    getPhy.Datarate = datarate;
+    getPhy.Attribute = PHY_SF_FROM_DR;
+    uint32_t spreadingFactor = RegionGetPhyParam(LmHandlerParams.Region, &getPhy).Value;
+    getPhy.Attribute = PHY_BW_FROM_DR;
+    uint32_t bandwidth = RegionGetPhyParam(LmHandlerParams.Region, &getPhy).Value;
+
+    // Same radio settings as the regions' own time on air calculations, the FSK
+    // datarates report their bit rate in kbps in place of a spreading factor
+    if (spreadingFactor == 50) {
+        return Radio.TimeOnAir(MODEM_FSK, bandwidth, spreadingFactor * 1000, 0, 5, false, LORAWAN_FRAME_OVERHEAD + data_len, true);
+    }
+
+    return Radio.TimeOnAir(MODEM_LORA, bandwidth, spreadingFactor, 1, 8, false, LORAWAN_FRAME_OVERHEAD + data_len, true);
+}
+
+int lorawan_time_on_air_ms(uint8_t data_len)
+{
+    MibRequestConfirm_t mibReq;
+
+    mibReq.Type = MIB_CHANNELS_DATARATE;
+    if (LoRaMacMibGetRequestConfirm(&mibReq) != LORAMAC_STATUS_OK) {
+        return -1;
+    }
+
+    return TimeOnAirMs(mibReq.Param.ChannelsDatarate, data_len);
+}
+
+int lorawan_request_time()
+{
+    if (LmHandlerDeviceTimeReq() != LORAMAC_HANDLER_SUCCESS) {
+        return -1;
+    }
 
-    if (LmHandlerSend(&appData, LORAMAC_HANDLER_UNCONFIRMED_MSG) != LORAMAC_HANDLER_SUCCESS) {
+    return 0;
+}
+
+int lorawan_receive_time(uint32_t* seconds, uint16_t* milliseconds)
+{
+    if (!IsTimeUpdatePending) {
         return -1;
     }
 
+    SysTime_t sysTime = SysTimeGet();
+
+    *seconds = sysTime.Seconds - GPS_UTC_LEAP_SECONDS;
+    *milliseconds = sysTime.SubSeconds;
+    IsTimeUpdatePending = false;
+
     return 0;
 }
 
 int lorawan_receive(void* data, uint8_t data_len, uint8_t* app_port)
 {
-    *app_port = AppRxData.Port;
-    if (*app_port == 0) {
+    struct lorawan_rx_info info;
+
+    int receive_length = lorawan_receive_info(data, data_len, &info);
+
+    *app_port = (receive_length < 0) ? 0 : info.app_port;
+
+    return receive_length;
+}
+
+int lorawan_receive_info(void* data, uint8_t data_len, struct lorawan_rx_info* info)
+{
+    if (RxQueueCount == 0) {
         return -1;
     }
 
-    int receive_length = AppRxData.BufferSize;
+    RxQueueEntry_t* entry = &RxQueue[RxQueueHead];
+    int receive_length = entry->BufferSize;
 
     if (data_len < receive_length) {
         receive_length = data_len;
     }
 
-    memcpy(data, AppRxData.Buffer, receive_length);
-    AppRxData.Port = 0;
+    memcpy(data, entry->Buffer, receive_length);
+    *info = entry->Info;
+
+    RxQueueHead = (RxQueueHead + 1) % LORAWAN_RX_QUEUE_DEPTH;
+    RxQueueCount--;
 
     return receive_length;
 }
 
+int lorawan_receive_pending()
+{
+    return RxQueueCount;
+}
+
+uint32_t lorawan_downlink_count()
+{
+    return DownlinkCount;
+}
+
 void lorawan_debug(bool debug)
 {
     Debug = debug;
@@ -374,20 +758,29 @@ static void OnNvmDataChange( LmHandlerNvmContextStates_t state, uint16_t size )
         DisplayNvmDataChange( state, size );
     }
 
-    EepromMcuFlush();
+    // Nothing to write back after a restore
+    if (state != LORAMAC_HANDLER_NVM_STORE) {
+        return;
+    }
+
+    if (IsNvmFlushPending || ++NvmStoresSinceFlush >= NVM_FLUSH_INTERVAL) {
+        EepromMcuFlush();
+        NvmStoresSinceFlush = 0;
+        IsNvmFlushPending = false;
+    }
 }
 
 static void OnNetworkParametersChange( CommissioningParams_t* params )
 {
     MibRequestConfirm_t mibReq;
 
-    const char* device_eui = NULL;
-    const char* app_eui = NULL;
-    const char* device_address = NULL;
-    const char* app_key = NULL;
-    const char* app_session_key = NULL;
-    const char* network_session_key = NULL;
-    const char* channel_mask = NULL;
+    const uint8_t* device_eui = NULL;
+    const uint8_t* app_eui = NULL;
+    const uint8_t* device_address = NULL;
+    const uint8_t* app_key = NULL;
+    const uint8_t* app_session_key = NULL;
+    const uint8_t* network_session_key = NULL;
+    const uint16_t* channel_mask = NULL;
 
     if (OtaaSettings != NULL) {
         params->IsOtaaActivation = 1;
@@ -416,15 +809,11 @@ static void OnNetworkParametersChange( CommissioningParams_t* params )
         LoRaMacMibSetRequestConfirm( &mibReq );
 
         if (device_address != NULL) {
-            params->DevAddr = 0;
-
-            for (int i = 0; i < 4; i++) {
-                int b;
-
-                sscanf(device_address + i * 2, "%2hhx", &b);
-
-                params->DevAddr = (params->DevAddr << 8) | b;
-            }
+            params->DevAddr =
+                ((uint32_t)device_address[0] << 24) |
+                ((uint32_t)device_address[1] << 16) |
+                ((uint32_t)device_address[2] << 8) |
+                device_address[3];
         } else {
             // Random seed initialization
             srand1( LmHandlerCallbacks.GetRandomSeed( ) );
@@ -438,117 +827,56 @@ static void OnNetworkParametersChange( CommissioningParams_t* params )
     }
 
     if (device_eui != NULL) {
-        uint8_t deviceEui[8];
-
-        for (int i = 0; i < 8; i++) {
-            int b;
-
-            sscanf(device_eui + i * 2, "%2x", &b);
-
-            deviceEui[i] = b;
-        }
-
         mibReq.Type = MIB_DEV_EUI;
-        mibReq.Param.DevEui = deviceEui;
+        mibReq.Param.DevEui = (uint8_t*)device_eui;
         LoRaMacMibSetRequestConfirm( &mibReq );
         memcpy1( params->DevEui, mibReq.Param.DevEui, 8 );
     }
 
     if (app_eui != NULL) {
-        uint8_t joinEui[8];
-
-        for (int i = 0; i < 8; i++) {
-            int b;
-
-            sscanf(app_eui + i * 2, "%2x", &b);
-
-            joinEui[i] = b;
-        }
-
         mibReq.Type = MIB_JOIN_EUI;
-        mibReq.Param.JoinEui = joinEui;
+        mibReq.Param.JoinEui = (uint8_t*)app_eui;
         LoRaMacMibSetRequestConfirm( &mibReq );
         memcpy1( params->JoinEui, mibReq.Param.JoinEui, 8 );
     }
 
     if (app_key) {
-        uint8_t appKey[16];
-
-        for (int i = 0; i < 16; i++) {
-            int b;
-
-            sscanf(app_key + i * 2, "%2x", &b);
-
-            appKey[i] = b;
-        }
-
         mibReq.Type = MIB_APP_KEY;
-        mibReq.Param.AppKey = appKey;
+        mibReq.Param.AppKey = (uint8_t*)app_key;
         LoRaMacMibSetRequestConfirm( &mibReq );
 
         mibReq.Type = MIB_NWK_KEY;
-        mibReq.Param.NwkKey = appKey;
+        mibReq.Param.NwkKey = (uint8_t*)app_key;
         LoRaMacMibSetRequestConfirm( &mibReq );
     }
 
     if (app_session_key) {
-        uint8_t appSessionKey[16];
-
-        for (int i = 0; i < 16; i++) {
-            int b;
-
-            sscanf(app_session_key + i * 2, "%2x", &b);
-
-            appSessionKey[i] = b;
-        }
-
         mibReq.Type = MIB_APP_S_KEY;
-        mibReq.Param.AppSKey = appSessionKey;
+        mibReq.Param.AppSKey = (uint8_t*)app_session_key;
         LoRaMacMibSetRequestConfirm( &mibReq );
     }
 
     if (network_session_key) {
-        uint8_t networkSessionKey[16];
-
-        for (int i = 0; i < 16; i++) {
-            int b;
-
-            sscanf(network_session_key + i * 2, "%2x", &b);
-
-            networkSessionKey[i] = b;
-        }
-
         mibReq.Type = MIB_F_NWK_S_INT_KEY;
-        mibReq.Param.FNwkSIntKey = networkSessionKey;
+        mibReq.Param.FNwkSIntKey = (uint8_t*)network_session_key;
         LoRaMacMibSetRequestConfirm( &mibReq );
 
         mibReq.Type = MIB_S_NWK_S_INT_KEY;
-        mibReq.Param.SNwkSIntKey = networkSessionKey;
+        mibReq.Param.SNwkSIntKey = (uint8_t*)network_session_key;
         LoRaMacMibSetRequestConfirm( &mibReq );
 
         mibReq.Type = MIB_NWK_S_ENC_KEY;
-        mibReq.Param.NwkSEncKey = networkSessionKey;
+        mibReq.Param.NwkSEncKey = (uint8_t*)network_session_key;
         LoRaMacMibSetRequestConfirm( &mibReq );
     }
 
     if (channel_mask != NULL) {
-        uint16_t channelMask[6];
-
-        for (int i = 0; i < 6; i++) {
-            int b[2];
-
-            sscanf(channel_mask + i * 4 + 0, "%2x", &b[0]);
-            sscanf(channel_mask + i * 4 + 2, "%2x", &b[1]);
-
-            channelMask[i] = (b[0] << 8) | b[1];
-        }
-
         mibReq.Type = MIB_CHANNELS_MASK;
-        mibReq.Param.ChannelsMask = channelMask;
+        mibReq.Param.ChannelsMask = (uint16_t*)channel_mask;
         LoRaMacMibSetRequestConfirm( &mibReq );
         
         mibReq.Type = MIB_CHANNELS_DEFAULT_MASK;
-        mibReq.Param.ChannelsDefaultMask = channelMask;
+        mibReq.Param.ChannelsDefaultMask = (uint16_t*)channel_mask;
         LoRaMacMibSetRequestConfirm( &mibReq );
     }
 
@@ -559,6 +887,15 @@ static void OnNetworkParametersChange( CommissioningParams_t* params )
 
 static void OnMacMcpsRequest( LoRaMacStatus_t status, McpsReq_t *mcpsReq, TimerTime_t nextTxIn )
 {
+    DutyCycleWaitStartTime = TimerGetCurrentTime();
+
+    // LmHandlerSend() falls back to an empty frame when the payload doesn't fit
+    // next to the pending MAC commands
+    if( ( status == LORAMAC_STATUS_OK ) && ( mcpsReq->Req.Unconfirmed.fBuffer == NULL ) )
+    {
+        IsTxPayloadFlushed = true;
+    }
+
     if (Debug) {
         DisplayMacMcpsRequestUpdate( status, mcpsReq, nextTxIn );
     }
@@ -566,6 +903,12 @@ static void OnMacMcpsRequest( LoRaMacStatus_t status, McpsReq_t *mcpsReq, TimerT
 
 static void OnMacMlmeRequest( LoRaMacStatus_t status, MlmeReq_t *mlmeReq, TimerTime_t nextTxIn )
 {
+    DutyCycleWaitStartTime = TimerGetCurrentTime();
+
+    if (mlmeReq->Type == MLME_JOIN) {
+        IsNvmFlushPending = true;
+    }
+
     if (Debug) {
         DisplayMacMlmeRequestUpdate( status, mlmeReq, nextTxIn );
     }
@@ -583,6 +926,9 @@ static void OnJoinRequest( LmHandlerJoinParams_t* params )
     }
     else
     {
+        // Write the new session out with the store that follows
+        IsNvmFlushPending = true;
+
         LmHandlerRequestClass( LORAWAN_DEFAULT_CLASS );
     }
 }
@@ -592,6 +938,39 @@ static void OnTxData( LmHandlerTxParams_t* params )
     if (Debug) {
         DisplayTxUpdate( params );
     }
+
+    if (params->IsMcpsConfirm) {
+        IsTxPending = false;
+
+        // Cleared before the call so that the callback can send the next uplink
+        lorawan_tx_callback_t callback = TxCallback;
+        TxCallback = NULL;
+
+        if (callback != NULL) {
+            struct lorawan_tx_status status;
+            bool flushed = IsTxPayloadFlushed && ( params->AppData.BufferSize > 0 );
+
+            if (flushed) {
+                status.result = LORAWAN_TX_PAYLOAD_DROPPED;
+            } else if (params->Status != LORAMAC_EVENT_INFO_STATUS_OK) {
+                status.result = LORAWAN_TX_ERROR;
+            } else {
+                status.result = LORAWAN_TX_OK;
+            }
+            status.mac_status = params->Status;
+            status.app_port = params->AppData.Port;
+            status.confirmed = ( params->MsgType == LORAMAC_HANDLER_CONFIRMED_MSG ) && !flushed;
+            status.ack_received = params->AckReceived;
+            status.datarate = params->Datarate;
+            status.tx_power = params->TxPower;
+            status.channel = params->Channel;
+            status.uplink_counter = params->UplinkCounter;
+            status.nb_trans = SX1276GetTxCount() - TxCountAtSend;
+            status.time_on_air_ms = TimeOnAirMs(params->Datarate, flushed ? 0 : params->AppData.BufferSize);
+
+            callback(&status, TxCallbackContext);
+        }
+    }
 }
 
 static void OnRxData( LmHandlerAppData_t* appData, LmHandlerRxParams_t* params )
@@ -600,9 +979,40 @@ static void OnRxData( LmHandlerAppData_t* appData, LmHandlerRxParams_t* params )
         DisplayRxUpdate( appData, params );
     }
 
-    memcpy(AppRxData.Buffer, appData->Buffer, appData->BufferSize);
-    AppRxData.BufferSize = appData->BufferSize;
-    AppRxData.Port = appData->Port;
+    if( appData != NULL )
+    {
+        DownlinkCount++;
+    }
+
+    // MLME indications come without application data and port 0 only ever
+    // carries MAC commands
+    if( ( appData == NULL ) || ( appData->Port == 0 ) )
+    {
+        return;
+    }
+
+    if( RxQueueCount >= LORAWAN_RX_QUEUE_DEPTH )
+    {
+        if( RxQueueDropped < UINT8_MAX )
+        {
+            RxQueueDropped++;
+        }
+        return;
+    }
+
+    RxQueueEntry_t* entry = &RxQueue[( RxQueueHead + RxQueueCount ) % LORAWAN_RX_QUEUE_DEPTH];
+
+    memcpy( entry->Buffer, appData->Buffer, appData->BufferSize );
+    entry->BufferSize = appData->BufferSize;
+    entry->Info.app_port = appData->Port;
+    entry->Info.rssi = params->Rssi;
+    entry->Info.snr = params->Snr;
+    entry->Info.rx_slot = params->RxSlot;
+    entry->Info.datarate = params->Datarate;
+    entry->Info.downlink_counter = params->DownlinkCounter;
+    entry->Info.dropped = RxQueueDropped;
+    RxQueueDropped = 0;
+    RxQueueCount++;
 }
 
 static void OnClassChange( DeviceClass_t deviceClass )
@@ -648,12 +1058,14 @@ static void OnBeaconStatusChange( LoRaMacHandlerBeaconParams_t* params )
 #if( LMH_SYS_TIME_UPDATE_NEW_API == 1 )
 static void OnSysTimeUpdate( bool isSynchronized, int32_t timeCorrection )
 {
-
+    if (isSynchronized) {
+        IsTimeUpdatePending = true;
+    }
 }
 #else
 static void OnSysTimeUpdate( void )
 {
-
+    IsTimeUpdatePending = true;
 }
 #endif
 
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Todd Buiten.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Turns the "#T" trace lines in a captured serial log back into text, using the
+# formats in trace_events.h. Any other line is passed through untouched.
+#
+#   python3 decode_trace.py < capture.log
+#   python3 decode_trace.py capture.log
+#
+
+import os
+import re
+import sys
+
+EVENTS_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), "trace_events.h")
+EVENT_PATTERN = re.compile(r'^TRACE_EVENT\(\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)', re.MULTILINE)
+RECORD_PATTERN = re.compile(r'#T([0-9a-f])([0-9a-f]{8})([0-9a-f]{4})([0-9a-f]{4})([0-9a-f]{8})([0-9a-f]{8})')
+SPEC_PATTERN = re.compile(r'%[-+ #0]*\d*(?:\.\d+)?([diuxXc%])')
+
+
+def load_events(path):
+    with open(path) as events_file:
+        return [(name, fmt) for name, fmt in EVENT_PATTERN.findall(events_file.read())]
+
+
+def signed(value, bits):
+    return value - (1 << bits) if value & (1 << (bits - 1)) else value
+
+
+def format_event(fmt, args):
+    values = []
+    widths = [16, 32, 32]
+    for index, spec in enumerate(spec for spec in SPEC_PATTERN.findall(fmt) if spec != "%"):
+        if index >= len(args):
+            break
+        value = args[index]
+        if spec in "di":
+            value = signed(value, widths[index])
+        values.append(value)
+    return fmt.replace("%u", "%d") % tuple(values)
+
+
+def decode(lines, events, output):
+    for line in lines:
+        match = RECORD_PATTERN.search(line)
+        if not match:
+            output.write(line)
+            continue
+
+        core, time_us, event, arg0, arg1, arg2 = (int(field, 16) for field in match.groups())
+        if event < len(events):
+            name, fmt = events[event]
+            text = format_event(fmt, [arg0, arg1, arg2])
+        else:
+            name, text = "UNKNOWN", "event %d: %04x %08x %08x" % (event, arg0, arg1, arg2)
+
+        output.write("[%10.6f] core%d %s: %s\n" % (time_us / 1000000.0, core, name, text))
+
+
+def main():
+    events = load_events(EVENTS_PATH)
+    if len(sys.argv) > 1:
+        with open(sys.argv[1], errors="replace") as capture:
+            decode(capture, events, sys.stdout)
+    else:
+        decode(sys.stdin, events, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
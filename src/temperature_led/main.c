@@ -6,8 +6,8 @@
  * 
  * This example uses OTAA to join the LoRaWAN network and then sends the 
  * internal temperature sensors value up as an uplink message periodically 
- * and the first byte of any uplink messages received controls the boards
- * built-in LED.
+ * and the first byte of any downlink message received on LED_COMMAND_PORT
+ * controls the boards built-in LED.
  */
 
 // NOTE: The max packet size that we allow for is 11 bytes corresponding to DR0 but we prefer three bytes where possible.
@@ -17,49 +17,78 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <malloc.h>
+#include <unistd.h>
 #include <time.h>
 #include <inttypes.h>
 
 #include "hardware/adc.h"
+#include "hardware/dma.h"
 #include "hardware/gpio.h"
 #include "hardware/watchdog.h"
-#include "hardware/rtc.h"
+#include "hardware/sync.h"
+#include "hardware/flash.h"
 
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
 #include "pico/critical_section.h"
 #include "pico/lorawan.h"
+#include "systime.h"
 #include "tusb.h"
 
 // edit with LoRaWAN Node Region and OTAA settings 
 #include "config.h"
+#include "message_journal.h"
+#include "message_series.h"
+#include "trace.h"
 
-#define MESSAGE_QUEUE_SIZE 100
+#ifndef MESSAGE_QUEUE_SIZE
+#define MESSAGE_QUEUE_SIZE 256
+#endif
 #define MESSAGE_VERSION 0
+#define MESSAGE_SERIES_VERSION 1
 #define BOOT_TIME_OFFSET_US 86400000000 // This must be >= the max of MESSAGE_TIMEOUT_US,
-                                        // TEMPERATURE_READING_TIMEOUT_US, and DAILY_TASK_TIMEOUT_US
-#define MESSAGE_TIMEOUT_US 600000000
+                                        // TEMPERATURE_READING_TIMEOUT_US, DAILY_TASK_TIMEOUT_US
+                                        // and TIME_RESYNC_TIMEOUT_US
+#define CONFIRMED_UPLINKS 0 // 1 - uplinks with guaranteed messages are confirmed and the MAC ack releases them,
+                            // 0 - the server acks each guaranteed message by echoing its header in a downlink
+#define MESSAGE_TIMEOUT_US 600000000 // Retry timeout for guaranteed messages until an ack has been timed
 #define DAILY_TASK_TIMEOUT_US 480000000
-#define TEMPERATURE_READING_TIMEOUT_US 180000000
+#define MESSAGE_STALE_AGE_S 432000 // The daily task drops unguaranteed messages still queued after 5 days
+#define SENSOR_BATCH_US 2000000 // Sensors due within this long of each other are sampled in the same wakeup
+#define TEMPERATURE_READING_TIMEOUT_US 10000000 // Sample the temperature every 10 seconds and
+#define TEMPERATURE_WINDOW_US 180000000         // summarize the samples every 3 minutes
+#define TEMPERATURE_HEARTBEAT_US 3600000000 // Report a window at least this often, even if nothing changed
+#define TEMPERATURE_REPORT_DELTA 10 // Tenths of a degree the mean has to move before a window is reported
+#define TEMPERATURE_ALERT_DELTA 30  // Tenths of a degree a single sample has to move to close the window early
+#define TEMPERATURE_ALERT_LOW 0     // Tenths of a degree, a sample crossing either of these
+#define TEMPERATURE_ALERT_HIGH 400  // closes the window early
+#define UPLINK_CYCLE_TIMEOUT_US 30000000 // Give up on an uplink cycle that never completes, on top
+                                         // of its duty cycle wait and time on air
+#define TIME_RESYNC_TIMEOUT_US 86400000000
+#define TIME_ZONE_OFFSET_S 0 // Local time offset from UTC, e.g. -28800 for PST
+#define MAX_SLEEP_MS 3600000
+#define BOOT_DELAY_MS 0 // Raise to e.g. 5000 to catch the boot messages on a USB console
+#define SESSION_CHECK_UPLINKS 3 // Uplinks a restored session gets to draw any downlink before we join again
+#define LED_COMMAND_PORT 2 // Downlinks on this port set the LED from their first byte, must not be a sensor port
+// Flash journal for guaranteed delivery messages, placed just below the sector
+// that eeprom-board.c uses for the LoRaWAN NVM
+#define JOURNAL_SECTOR_COUNT 4
+#define JOURNAL_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE - (JOURNAL_SECTOR_COUNT * FLASH_SECTOR_SIZE))
+#define JOURNAL_FLUSH_DELAY_US 5000000
+// Dual core mode - core1 samples the sensors and captures GPIO events, core0 runs
+// the LoRaWAN stack. Set to 0 to do everything on core0
+#ifndef DUAL_CORE_MODE
+#define DUAL_CORE_MODE 1
+#endif
+#define SENSOR_RING_SIZE 32 // must be a power of two
 // Debug levels
 //   0 - Off
 //   1 - Exceptions
 //   2 - New messages
 //   3 - Tracing
+#ifndef DEBUG_LEVEL
 #define DEBUG_LEVEL 3
-
-uint32_t getTotalHeap(void) {
-   extern char __StackLimit, __bss_end__;
-
-   return &__StackLimit  - &__bss_end__;
-}
-
-uint32_t getFreeHeap(void) {
-   struct mallinfo m = mallinfo();
-
-   return getTotalHeap() - m.uordblks;
-}
+#endif
 
 uint64_t get_us_since_boot() {
     // Adding BOOT_TIME_OFFSET_US helps with comparisons when
@@ -81,12 +110,29 @@ const struct lorawan_sx1276_settings sx1276_settings = {
     .dio1  = 10
 };
 
-// OTAA settings
-const struct lorawan_otaa_settings otaa_settings = {
-    .device_eui   = LORAWAN_DEVICE_EUI,
-    .app_eui      = LORAWAN_APP_EUI,
-    .app_key      = LORAWAN_APP_KEY,
-    .channel_mask = LORAWAN_CHANNEL_MASK
+// OTAA settings, the hex strings in config.h are turned into bytes at compile time
+// so that nothing needs to be parsed at boot
+#if !defined(LORAWAN_APP_EUI) || !defined(LORAWAN_APP_KEY)
+#error "config.h must define LORAWAN_APP_EUI and LORAWAN_APP_KEY as hex strings, see config.sample"
+#endif
+#ifdef LORAWAN_DEVICE_EUI
+static const uint8_t device_eui[] = LORAWAN_HEX_8(LORAWAN_DEVICE_EUI);
+#endif
+static const uint8_t app_eui[] = LORAWAN_HEX_8(LORAWAN_APP_EUI);
+static const uint8_t app_key[] = LORAWAN_HEX_16(LORAWAN_APP_KEY);
+#ifdef LORAWAN_CHANNEL_MASK
+static const uint16_t channel_mask[] = LORAWAN_HEX_CHANNEL_MASK(LORAWAN_CHANNEL_MASK);
+#endif
+
+const struct lorawan_otaa_binary_settings otaa_settings = {
+#ifdef LORAWAN_DEVICE_EUI
+    .device_eui   = device_eui,
+#endif
+    .app_eui      = app_eui,
+    .app_key      = app_key,
+#ifdef LORAWAN_CHANNEL_MASK
+    .channel_mask = channel_mask
+#endif
 };
 
 //
@@ -105,6 +151,11 @@ const struct lorawan_otaa_settings otaa_settings = {
 //   type - (0..31) (user-defined messge type)
 //   content_length - (0..11) (length of the message content)
 //
+// A version 1 (MESSAGE_SERIES_VERSION) header is followed by a run of same-type
+// messages encoded by message_series.c. Its timestamp and type are those of the
+// first message in the run and its content_length is the length of the encoded
+// series in 4 byte words.
+//
 // timestamp format
 // +---------+-----------+
 // |   DOW   |   time    |
@@ -115,28 +166,171 @@ const struct lorawan_otaa_settings otaa_settings = {
 //   DOW - 0..6, 0 is Sunday
 //   time - 0..86400 (seconds past midnight)
 //
+// Only the header, content and f_port are stored, everything else that's in the
+// header is derived from it by the message_*() accessors below. Entries are 24
+// bytes and 8 byte aligned so that a record never straddles two SRAM words more
+// than it has to.
+//
 struct message_entry {
   uint32_t header;
   uint8_t content[7];
   /* extra data that's not transmitted */
-  uint8_t version;
   uint8_t f_port;
-  bool guaranteed_delivery;
-  uint8_t type;
-  uint8_t content_length;
-  uint64_t send_time;
-  uint8_t dow;
-  uint16_t index;
-  struct message_entry* next;
+  uint32_t send_time; // get_us_since_boot() in seconds of the last send, or of queuing if never sent
+  uint16_t journal_slot;
+  uint16_t previous; // message_pool indices, MESSAGE_NONE at either end of the queue
+  uint16_t next;
+  uint8_t send_count; // 0 if never sent
+  uint8_t priority;
+} __attribute__((aligned(8)));
+
+_Static_assert(sizeof(struct message_entry) == 24, "message_entry should stay 24 bytes");
+
+#define MESSAGE_NONE 0xFFFF
+
+static uint32_t message_timestamp( const struct message_entry* message ) {
+    return (message->header >> 9) & 0xFFFFF;
+}
+
+static bool message_guaranteed_delivery( const struct message_entry* message ) {
+    return (message->header >> 8) & 0x01;
+}
+
+static uint8_t message_type( const struct message_entry* message ) {
+    return (message->header >> 4) & 0x0F;
+}
+
+static uint8_t message_content_length( const struct message_entry* message ) {
+    return message->header & 0x0F;
+}
+
+//
+// Priority classes
+//
+// Every class has its own queue, oldest message first. Uplinks are packed from
+// the highest priority class down, so a burst of telemetry never holds up an
+// alarm, and within a class the oldest message, the one closest to its deadline,
+// goes first. A message that hasn't been sent within its class's max age (0 for
+// never) is dropped. When the pool is full the oldest message of the lowest class
+// that isn't above the new message's class makes room; guaranteed messages only
+// make room for a higher class.
+//
+enum message_priority {
+    MESSAGE_PRIORITY_ALARM,
+    MESSAGE_PRIORITY_CONTROL,
+    MESSAGE_PRIORITY_TELEMETRY,
+    MESSAGE_PRIORITY_HOUSEKEEPING,
+    MESSAGE_PRIORITY_COUNT
+};
+
+static const uint32_t message_max_age_s[MESSAGE_PRIORITY_COUNT] = {
+    0,    // alarm
+    0,    // control
+    7200, // telemetry
+    86400 // housekeeping
 };
-struct message_entry* message_queue = NULL;
-struct message_entry* free_queue = NULL;
+
+//
+// Message slab
+//
+// Every message_entry lives in message_pool. Entries that are in use are linked
+// into the message_queues of their class (oldest first) through previous/next so
+// that they can be unlinked without walking the list. Free slots are tracked in a two-level bitmap:
+// a set bit in free_bitmap marks a free slot and a set bit in free_summary marks
+// a free_bitmap word with at least one free slot. Allocation, removal and the
+// counts are therefore constant time regardless of MESSAGE_QUEUE_SIZE.
+//
+#define FREE_BITMAP_WORDS ((MESSAGE_QUEUE_SIZE + 31) / 32)
+#define FREE_SUMMARY_WORDS ((FREE_BITMAP_WORDS + 31) / 32)
+static struct message_entry message_pool[MESSAGE_QUEUE_SIZE];
+static uint32_t free_bitmap[FREE_BITMAP_WORDS];
+static uint32_t free_summary[FREE_SUMMARY_WORDS];
+static uint32_t free_entry_count = 0;
+static uint32_t message_queue_count = 0;
+static uint32_t message_queue_high_water = 0;
+struct message_entry* message_queues[MESSAGE_PRIORITY_COUNT];
+static struct message_entry* message_queue_tails[MESSAGE_PRIORITY_COUNT];
 static critical_section_t message_queue_cri_sec;
-static critical_section_t free_queue_cri_sec;
+
+static uint16_t message_pool_index( const struct message_entry* message ) {
+    return message - message_pool;
+}
+
+static struct message_entry* message_at( uint16_t index ) {
+    return (index == MESSAGE_NONE) ? NULL : &message_pool[index];
+}
+
+static struct message_entry* message_next( const struct message_entry* message ) {
+    return message_at(message->next);
+}
+
+//
+// Ack index
+//
+// Open-addressing (linear probing) hash table over the in-use entries, keyed on
+// the fields that a downlink ack echoes back: f_port, type, timestamp and the
+// guaranteed delivery flag. Each bucket holds a message_pool index. Deletion uses
+// backward shifting so that there are no tombstones and probe sequences stay short
+// no matter how long the backlog has been churning.
+//
+#ifndef MESSAGE_INDEX_BITS
+#define MESSAGE_INDEX_BITS 9 // 2^MESSAGE_INDEX_BITS must be >= 2 * MESSAGE_QUEUE_SIZE
+#endif
+#define MESSAGE_INDEX_SIZE (1 << MESSAGE_INDEX_BITS)
+#define MESSAGE_INDEX_EMPTY 0xFFFF
+#if MESSAGE_QUEUE_SIZE >= MESSAGE_NONE
+#error "MESSAGE_QUEUE_SIZE must fit in a 16 bit pool index"
+#endif
+#if MESSAGE_INDEX_SIZE < (2 * MESSAGE_QUEUE_SIZE)
+#error "MESSAGE_INDEX_BITS is too small for MESSAGE_QUEUE_SIZE"
+#endif
+static uint16_t message_index[MESSAGE_INDEX_SIZE];
+
+//
+// Sensor plugins
+//
+// Every sensor is a plugin in sensor_plugins[] that declares the message it
+// produces (f_port, type, priority and delivery) and how often it wants to be
+// sampled. service_sensors() is the only scheduler: it calls sample() on every
+// plugin that is due and, when sample() says a message is ready, encode() to
+// fill in the message content. Sensors that are driven by interrupts rather than
+// a period are woken up with wake_sensor().
+//
+struct sensor_plugin {
+    const char* name;
+    uint8_t f_port;
+    uint8_t type;
+    uint8_t priority;
+    bool guaranteed_delivery;
+    uint8_t channel; // plugin specific, e.g. the GPIO of a door sensor
+    uint64_t period_us; // 0 for sensors that only run when woken up
+
+    void (*init)( const struct sensor_plugin* plugin );
+    // Takes a sample and sets ready if a message should go out. Returns when the
+    // plugin next wants to run, UINT64_MAX to wait for wake_sensor()
+    uint64_t (*sample)( const struct sensor_plugin* plugin, uint64_t now, bool* ready );
+    // Fills in up to 7 bytes of message content and returns the length
+    uint8_t (*encode)( const struct sensor_plugin* plugin, uint8_t* content );
+    // Optional, called when an ack releases one of the plugin's messages
+    void (*on_ack)( const struct sensor_plugin* plugin, uint32_t header );
+};
+enum sensor_plugin_id {
+    SENSOR_TEMPERATURE,
+    SENSOR_DOOR_0,
+    SENSOR_DOOR_1,
+    SENSOR_PLUGIN_COUNT
+};
 
 // functions used in main
 void internal_temperature_init();
-float internal_temperature_get();
+int16_t internal_temperature_get();
+void scheduled_daily_tasks( void );
+const struct sensor_plugin* find_sensor_plugin( uint8_t f_port, uint8_t type );
+bool is_sensor_port( uint8_t f_port );
+void wake_sensor( enum sensor_plugin_id id, uint64_t due_time );
+uint64_t service_sensors( void );
+void report_high_water( void );
+bool sensor_events_pending( void* context );
 
 void erase_nvm( void ) {
     if (DEBUG_LEVEL >= 3) {
@@ -158,17 +352,22 @@ void machine_reset() {
     if (DEBUG_LEVEL >= 1) {
         printf("Panic: resetting Pico!");
     }
+    message_journal_flush(); // Don't lose guaranteed messages that are still buffered
     sleep_ms(5000); // Wait for all printfs to complete
     watchdog_enable(1, 0);
     while (1);
 }
 
+// Set when join() resumed the session saved before the last reset
+bool session_restored = false;
+int session_check_uplinks = 0;
+
 void join( void ) {
     // initialize the LoRaWAN stack
     if (DEBUG_LEVEL >= 3) {
         printf("Initializating LoRaWAN ... ");
     }
-    if (lorawan_init_otaa(&sx1276_settings, LORAWAN_REGION, &otaa_settings) < 0) {
+    if (lorawan_init_otaa_binary(&sx1276_settings, LORAWAN_REGION, &otaa_settings) < 0) {
         if (DEBUG_LEVEL >= 1) {
             printf("failed to initialize OTAA - retarting!!!\n");
         }
@@ -180,13 +379,16 @@ void join( void ) {
         printf("success!\n");
     }
 
-    // if (lorawan_is_joined()) {
-    //     if (DEBUG_LEVEL >= 3) {
-    //         printf("LoRaWAN has already been joined, skipping lorawan_join()!\n");
-    //     }
+    // Warm boot, carry on with the session from before the reset. The first few
+    // uplinks tell whether the network still accepts it, see check_restored_session()
+    if (lorawan_is_joined()) {
+        if (DEBUG_LEVEL >= 3) {
+            printf("Restored the LoRaWAN session, skipping lorawan_join()!\n");
+        }
+        session_restored = true;
 
-    //     return;
-    // }
+        return;
+    }
 
     // Start the join process and wait
     if (DEBUG_LEVEL >= 3) {
@@ -206,7 +408,6 @@ void join( void ) {
                 printf("failed to join (timeout) - restarting!!!\n");
             }
             sleep_ms(5000); // Wait for printf to complete
-            erase_nvm();
             machine_reset();
         }
     }
@@ -216,680 +417,1958 @@ void join( void ) {
     }
 }
 
-int get_free_entry_count() {
-    int count = 0;
-    struct message_entry* current = free_queue;
+void init_message_queue( void ) {
+    critical_section_init(&message_queue_cri_sec);
 
-    while (current != NULL) {
-        count++;
-        current = current->next;
+    memset(free_bitmap, 0, sizeof(free_bitmap));
+    memset(free_summary, 0, sizeof(free_summary));
+    for (int i = 0; i < MESSAGE_QUEUE_SIZE; i++) {
+        message_pool[i].previous = MESSAGE_NONE;
+        message_pool[i].next = MESSAGE_NONE;
+        free_bitmap[i / 32] |= 1u << (i % 32);
+        free_summary[i / 1024] |= 1u << ((i / 32) % 32);
     }
 
-    return count;
-}
-
-void cleanup_message( struct message_entry* message ) {
-    if (message == NULL) {
-        return;
+    for (int i = 0; i < MESSAGE_PRIORITY_COUNT; i++) {
+        message_queues[i] = NULL;
+        message_queue_tails[i] = NULL;
     }
+    message_queue_count = 0;
+    free_entry_count = MESSAGE_QUEUE_SIZE;
 
-    critical_section_enter_blocking(&message_queue_cri_sec);
-    if (message == message_queue) {
-        message_queue = message->next;
-    } else {
-        struct message_entry* previous = message_queue;
-        struct message_entry* current = message_queue->next;
-        while (current != NULL) {
-            if (current == message) {
-                previous->next = current->next;
-                break;
-            }
+    for (int i = 0; i < MESSAGE_INDEX_SIZE; i++) {
+        message_index[i] = MESSAGE_INDEX_EMPTY;
+    }
+}
 
-            previous = current;
-            current = current->next;
+// Must be called with message_queue_cri_sec held
+static struct message_entry* allocate_message_entry( void ) {
+    for (int i = 0; i < FREE_SUMMARY_WORDS; i++) {
+        if (free_summary[i] == 0) {
+            continue;
         }
 
-        if (current == NULL) {
-            printf("Failed to remove message from message list- port = %d!!!", message->f_port);
+        int word = (i * 32) + __builtin_ctz(free_summary[i]);
+        int index = (word * 32) + __builtin_ctz(free_bitmap[word]);
+
+        free_bitmap[word] &= ~(1u << (index % 32));
+        if (free_bitmap[word] == 0) {
+            free_summary[i] &= ~(1u << (word % 32));
         }
+        free_entry_count--;
+
+        return &message_pool[index];
     }
-    critical_section_exit(&message_queue_cri_sec);
 
-    critical_section_enter_blocking(&free_queue_cri_sec);
-    message->next = free_queue;
-    free_queue = message;
-    critical_section_exit(&free_queue_cri_sec);
+    return NULL;
+}
 
-    if (DEBUG_LEVEL >= 3) {
-        printf("Free message entries available: %d\n", get_free_entry_count());
-    }
+// Must be called with message_queue_cri_sec held
+static void release_message_entry( struct message_entry* message ) {
+    uint16_t index = message_pool_index(message);
+
+    free_bitmap[index / 32] |= 1u << (index % 32);
+    free_summary[index / 1024] |= 1u << ((index / 32) % 32);
+    free_entry_count++;
 }
 
-uint32_t create_message_timestamp() {
-    datetime_t current_time;
+static bool is_message_entry_free( struct message_entry* message ) {
+    uint16_t index = message_pool_index(message);
+
+    return (free_bitmap[index / 32] & (1u << (index % 32))) != 0;
+}
 
-    rtc_get_datetime(&current_time);
+static uint32_t message_index_hash( uint8_t f_port, bool guaranteed_delivery, uint8_t type, uint32_t timestamp ) {
+    uint32_t key =
+        ((timestamp & 0xFFFFF) << 12) ^
+        (f_port << 5) ^
+        ((type & 0x0F) << 1) ^
+        (guaranteed_delivery ? 1 : 0);
 
-    return (current_time.dotw << 17) +
-           current_time.hour * 3600 +
-           current_time.min * 60 +
-           current_time.sec;
+    // Fibonacci hashing, keep the top MESSAGE_INDEX_BITS bits
+    return (key * 2654435761u) >> (32 - MESSAGE_INDEX_BITS);
 }
 
-void create_message_entry(uint8_t f_port, bool guaranteed_delivery, uint8_t type, uint8_t* content, uint8_t content_length) {
-    uint32_t timestamp = create_message_timestamp();
+static uint32_t message_index_home( struct message_entry* message ) {
+    return message_index_hash(message->f_port, message_guaranteed_delivery(message), message_type(message), message_timestamp(message));
+}
 
-    if (content_length > 7) {
-        content_length = 7;
-    }
+static bool message_matches( struct message_entry* message, uint8_t f_port, bool guaranteed_delivery, uint8_t type, uint32_t timestamp ) {
+    return (f_port == message->f_port) &&
+           (timestamp == message_timestamp(message)) &&
+           (guaranteed_delivery == message_guaranteed_delivery(message)) &&
+           (type == message_type(message));
+}
 
-    if (!free_queue) {
-        printf("Free queue exhausted\n");
-        machine_reset();
-    }
+// Must be called with message_queue_cri_sec held
+static void message_index_insert( struct message_entry* message ) {
+    uint32_t bucket = message_index_home(message);
 
-    if (DEBUG_LEVEL >= 3) {
-        printf("Creating new message on port %d with length = %d\n", f_port, content_length);
+    while (message_index[bucket] != MESSAGE_INDEX_EMPTY) {
+        bucket = (bucket + 1) & (MESSAGE_INDEX_SIZE - 1);
     }
 
-    critical_section_enter_blocking(&free_queue_cri_sec);
-    struct message_entry* message = free_queue;
-    free_queue = free_queue->next;
-    critical_section_exit(&free_queue_cri_sec);
+    message_index[bucket] = message_pool_index(message);
+}
 
-    if (message->index >= MESSAGE_QUEUE_SIZE) {
-        printf("message index of %d is greater than the message queue size of %d\n", message->index, MESSAGE_QUEUE_SIZE);
-        machine_reset();
-    }
+// Must be called with message_queue_cri_sec held
+static void message_index_remove( struct message_entry* message ) {
+    uint32_t bucket = message_index_home(message);
 
-    message->header =
-        ((MESSAGE_VERSION & 0x07) << 29) |
-        ((timestamp & 0xFFFFF) << 9) |
-        (guaranteed_delivery ? 1 : 0) << 8 |
-        ((type & 0x0F) << 4) |
-        (content_length & 0x0F);
+    while (message_index[bucket] != message_pool_index(message)) {
+        if (message_index[bucket] == MESSAGE_INDEX_EMPTY) {
+            return;
+        }
+        bucket = (bucket + 1) & (MESSAGE_INDEX_SIZE - 1);
+    }
 
-    message->version = MESSAGE_VERSION;
-    message->f_port = f_port;
-    message->guaranteed_delivery = guaranteed_delivery;
-    message->type = type;
-    message->content_length = content_length;
-    message->send_time = 0;
-    message->dow = (timestamp >> 17) & 0x07;
-    memcpy(&message->content[0], content, message->content_length);
-
-    // Hook our message into the queue
-    critical_section_enter_blocking(&message_queue_cri_sec);
-    message->next = message_queue;
-    message_queue = message;
-    critical_section_exit(&message_queue_cri_sec);
+    // Shift later members of the probe run back into the hole so that lookups
+    // never stop early on an empty bucket
+    uint32_t hole = bucket;
+    uint32_t next = bucket;
+    while (1) {
+        next = (next + 1) & (MESSAGE_INDEX_SIZE - 1);
+        if (message_index[next] == MESSAGE_INDEX_EMPTY) {
+            break;
+        }
 
-    if (DEBUG_LEVEL >= 3) {
-        printf("Free message entries available: %d\n", get_free_entry_count());
+        uint32_t home = message_index_home(&message_pool[message_index[next]]);
+        bool home_in_range = (hole <= next) ?
+            ((home > hole) && (home <= next)) :
+            ((home > hole) || (home <= next));
+        if (!home_in_range) {
+            message_index[hole] = message_index[next];
+            hole = next;
+        }
     }
+
+    message_index[hole] = MESSAGE_INDEX_EMPTY;
 }
 
-struct message_entry* match_message_by_header( uint8_t version, uint8_t receive_port, bool guaranteed_delivery, uint8_t type, uint32_t response_timestamp ) {
-    struct message_entry* current = message_queue;
+int get_free_entry_count() {
+    return free_entry_count;
+}
 
-    while (current != NULL) {
-        uint32_t message_timestamp = (current->header >> 9) & 0xFFFFF;
+void cleanup_message( struct message_entry* message ) {
+    if (message == NULL) {
+        return;
+    }
 
-        if ((receive_port == current->f_port) &&
-            (response_timestamp == message_timestamp) &&
-            (guaranteed_delivery == current->guaranteed_delivery) &&
-            (type == current->type)) {
-            break;
+    critical_section_enter_blocking(&message_queue_cri_sec);
+    if (is_message_entry_free(message)) {
+        critical_section_exit(&message_queue_cri_sec);
+        if (DEBUG_LEVEL >= 1) {
+            printf("Failed to remove message from message list- port = %d!!!", message->f_port);
         }
+        return;
+    }
 
-        current = current->next;
+    if (message->previous != MESSAGE_NONE) {
+        message_pool[message->previous].next = message->next;
+    } else {
+        message_queues[message->priority] = message_at(message->next);
     }
+    if (message->next != MESSAGE_NONE) {
+        message_pool[message->next].previous = message->previous;
+    } else {
+        message_queue_tails[message->priority] = message_at(message->previous);
+    }
+    message->previous = MESSAGE_NONE;
+    message->next = MESSAGE_NONE;
+    message_queue_count--;
 
-    return current;
-}
+    message_index_remove(message);
+    release_message_entry(message);
+    uint16_t journal_slot = message->journal_slot;
+    critical_section_exit(&message_queue_cri_sec);
 
-uint32_t queued_message_count() {
-    struct message_entry* current = message_queue;
-    uint32_t count = 0;
+    message_journal_remove(journal_slot);
 
-    while (current != NULL) {
-        count++;
-        current = current->next;
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_FREE_ENTRIES, get_free_entry_count(), 0, 0);
     }
-
-    return count;
 }
 
-bool is_leap_year(int16_t year) {
-    return (((year % 4 == 0) && (year % 100) != 0) || ((year % 400) == 0));
-}
+//
+// Epoch timebase
+//
+// Local time is the microsecond timer plus epoch_offset_us, microseconds since the
+// Unix epoch shifted by TIME_ZONE_OFFSET_S. Reading it is a 64-bit add, so message
+// timestamps never touch the RTC or do any calendar arithmetic. Calendar fields are
+// only worked out, with SysTimeLocalTime(), for debug output. Until the network
+// time arrives the clock counts from Jan 1, 2000.
+//
+// The offset is 64 bits wide and core1 reads it while core0 updates it, hence
+// the critical section.
+//
+#define EPOCH_2000_S 946684800
+#define SECONDS_PER_DAY 86400
+static int64_t epoch_offset_us = EPOCH_2000_S * 1000000LL;
+static critical_section_t epoch_cri_sec;
 
-int8_t time_component_limits_min[5] = { 0, 0, 0, 1, 1 };
-int8_t getTimeComponentLimitMin(int component_number) {
-    return time_component_limits_min[component_number];
-}
+uint64_t get_local_time_us( void ) {
+    critical_section_enter_blocking(&epoch_cri_sec);
+    int64_t offset_us = epoch_offset_us;
+    critical_section_exit(&epoch_cri_sec);
 
-int8_t time_component_limits_max[5] = { 60, 60, 24, 31 /* Unused, see getTimeComponentLimitMax */, 12 };
-int8_t time_component_month_limits_max[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
-int8_t getTimeComponentLimitMax(int component_number, int8_t month, int16_t year) {
-    if (component_number == 3) {
-        if (month == 2) {
-            int time_component_limit_max = time_component_month_limits_max[month - 1];
-            if (is_leap_year(year)) {
-                time_component_limit_max++;
-            }
+    return time_us_64() + offset_us;
+}
 
-            return time_component_limit_max;
-        }
+void set_local_time_us( uint64_t local_time_us ) {
+    critical_section_enter_blocking(&epoch_cri_sec);
+    epoch_offset_us = local_time_us - time_us_64();
+    critical_section_exit(&epoch_cri_sec);
+}
 
-        return time_component_month_limits_max[month - 1];
-    }
+// Jan 1, 1970 was a Thursday
+uint8_t local_time_dow( uint64_t local_time_us ) {
+    return ((local_time_us / 1000000 / SECONDS_PER_DAY) + 4) % 7;
+}
 
-    return time_component_limits_max[component_number];
+void print_local_time( uint64_t local_time_us ) {
+    struct tm local_time;
+
+    SysTimeLocalTime(local_time_us / 1000000, &local_time);
+    printf("%04d-%02d-%02d %02d:%02d:%02d (%d)",
+        local_time.tm_year + 1900,
+        local_time.tm_mon + 1,
+        local_time.tm_mday,
+        local_time.tm_hour,
+        local_time.tm_min,
+        local_time.tm_sec,
+        local_time.tm_wday
+    );
 }
 
-int8_t month_key[12] = { 1, 4, 4, 0, 2, 5, 0, 3, 6, 1, 4, 6 };
-int8_t calculate_dow(int8_t day, int8_t month, int16_t year) {
-    int8_t day_of_week =
-        day +
-        month_key[month - 1] +
-        ((month == 1 || month == 2) && is_leap_year(year) ? -1 : 0) -
-        1 - // Take one off from 2000 - 2099
-        1;  // Shift from Sat = 0 to Sun = 0
-    year = year % 100;
-    day_of_week += year + (year / 4);
-    day_of_week = day_of_week % 7;
+uint32_t create_message_timestamp() {
+    uint64_t local_time_us = get_local_time_us();
 
-    return day_of_week;
+    return (local_time_dow(local_time_us) << 17) +
+           ((local_time_us / 1000000) % SECONDS_PER_DAY);
 }
 
-void sync_time_on_timestamp( uint8_t* receive_buffer) {
-    datetime_t current_time;
+// Frees up an entry for a message of class priority, returns false if every
+// queued message is more important than that
+bool evict_message_entry( enum message_priority priority ) {
+    for (int i = MESSAGE_PRIORITY_COUNT - 1; i >= (int) priority; i--) {
+        struct message_entry* victim = NULL;
 
-    rtc_get_datetime(&current_time);
-    for (int i = 4; i < 11; i++) {
-        receive_buffer[i] -= 128;
+        critical_section_enter_blocking(&message_queue_cri_sec);
+        for (struct message_entry* message = message_queues[i]; message != NULL; message = message_next(message)) {
+            if (i > (int) priority || !message_guaranteed_delivery(message)) {
+                victim = message;
+                break;
+            }
+        }
+        critical_section_exit(&message_queue_cri_sec);
+
+        if (victim != NULL) {
+            if (DEBUG_LEVEL >= 1) {
+                printf("Free queue exhausted, dropping message 0x%08" PRIx32 " of class %d\n", victim->header, victim->priority);
+            }
+            cleanup_message(victim);
+            return true;
+        }
     }
 
-    current_time.year += (receive_buffer[4] * 100) + receive_buffer[5];
-    current_time.month += receive_buffer[6];
-    current_time.day += receive_buffer[7];
-    current_time.hour += receive_buffer[8];
-    current_time.min += receive_buffer[9];
-    current_time.sec += receive_buffer[10];
-    current_time.dotw = 0;
+    return false;
+}
 
-    int8_t* time_components[5] = {
-        &current_time.sec,
-        &current_time.min,
-        &current_time.hour,
-        &current_time.day,
-        &current_time.month
-    };
+void insert_message_entry(uint8_t f_port, enum message_priority priority, uint32_t header, const uint8_t* content, uint16_t journal_slot) {
+    critical_section_enter_blocking(&message_queue_cri_sec);
+    struct message_entry* message = allocate_message_entry();
+    critical_section_exit(&message_queue_cri_sec);
 
-    for (int i = 0; i < 5; i++) {
-        int8_t time_component_limit_min = getTimeComponentLimitMin(i);
-        int8_t time_component_limit_max = getTimeComponentLimitMax(i, current_time.month, current_time.year);
+    if (message == NULL && evict_message_entry(priority)) {
+        critical_section_enter_blocking(&message_queue_cri_sec);
+        message = allocate_message_entry();
+        critical_section_exit(&message_queue_cri_sec);
+    }
 
-        if (*time_components[i] < time_component_limit_min) {
-            i < 4 ? (*time_components[i+1])-- : current_time.year--;
-            *time_components[i] += time_component_limit_max;
-        } else if (*time_components[i] >= (time_component_limit_max + time_component_limit_min)) {
-            i < 4 ? (*time_components[i+1])++ : current_time.year++;
-            *time_components[i] -= time_component_limit_max;
+    if (message == NULL) {
+        if (DEBUG_LEVEL >= 1) {
+            printf("Free queue exhausted, dropping new message 0x%08" PRIx32 " of class %d\n", header, priority);
         }
+        message_journal_remove(journal_slot);
+        return;
     }
 
-    // Calculate the day of week
-    current_time.dotw = calculate_dow(current_time.day, current_time.month, current_time.year);
+    message->header = header;
+    message->f_port = f_port;
+    message->priority = priority;
+    message->send_time = get_us_since_boot() / 1000000;
+    message->send_count = 0;
+    message->journal_slot = journal_slot;
+    memcpy(&message->content[0], content, message_content_length(message));
 
-    if (DEBUG_LEVEL >= 3) {
-        printf("Setting time to %02d-%02d-%02d %02d:%02d:%02d (%d)\n",
-            current_time.year,
-            current_time.month,
-            current_time.day,
-            current_time.hour,
-            current_time.min,
-            current_time.sec,
-            current_time.dotw
-        );
+    // Hook our message onto the end of its class's queue
+    critical_section_enter_blocking(&message_queue_cri_sec);
+    struct message_entry* tail = message_queue_tails[priority];
+    message->previous = MESSAGE_NONE;
+    message->next = MESSAGE_NONE;
+    if (tail != NULL) {
+        message->previous = message_pool_index(tail);
+        tail->next = message_pool_index(message);
+    } else {
+        message_queues[priority] = message;
     }
+    message_queue_tails[priority] = message;
+    message_queue_count++;
+    if (message_queue_count > message_queue_high_water) {
+        message_queue_high_water = message_queue_count;
+    }
+    message_index_insert(message);
+    critical_section_exit(&message_queue_cri_sec);
 
-    rtc_set_datetime(&current_time);
-    sleep_ms(1); // Let the RTC stabiize
-
-    rtc_get_datetime(&current_time);
-    if (DEBUG_LEVEL >= 2) {
-        printf("Date updated to %02d-%02d-%02d %02d:%02d:%02d (%d)\n",
-            current_time.year,
-            current_time.month,
-            current_time.day,
-            current_time.hour,
-            current_time.min,
-            current_time.sec,
-            current_time.dotw
-        );
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_FREE_ENTRIES, get_free_entry_count(), 0, 0);
     }
 }
 
-bool skip_first_received_messages = true;
-int failed_send_packet_count = 0;
-bool transfer_data() {
-    int receive_length = 0;
-    uint8_t receive_buffer[242];
-    uint8_t receive_port = 0;
-
-    struct message_entry* message = message_queue;
+void create_message_entry_at(uint32_t timestamp, uint8_t f_port, enum message_priority priority, bool guaranteed_delivery, uint8_t type, uint8_t* content, uint8_t content_length) {
+    uint16_t journal_slot = MESSAGE_JOURNAL_NO_SLOT;
 
-    if (failed_send_packet_count > 5) {
-        if (DEBUG_LEVEL >= 1) {
-            printf("More than five failed lorawan_send_unconfirmed() calls in a row, resetting device");
-        }
-        machine_reset();
+    if (content_length > 7) {
+        content_length = 7;
     }
 
-    // Since we're a Class A device, if we send no uplinks then we get no downlinks either
-    if (message == NULL) {
-        return true;
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_CREATE_MESSAGE, f_port, content_length, 0);
     }
 
-    while (message) {
-        bool message_sent = false;
-        struct message_entry* next_message = message->next;
-
-        if (DEBUG_LEVEL >= 3) {
-            printf("get_us_since_boot: %" PRIu64 ", message->send_time: %" PRIu64 ", math: %" PRIu64 ", MESSAGE_TIMEOUT_US: %d\n",
-                get_us_since_boot(),
-                message->send_time,
-                get_us_since_boot() - message->send_time,
-                MESSAGE_TIMEOUT_US);
-        }
-        if ((get_us_since_boot() - message->send_time) > MESSAGE_TIMEOUT_US) {
-            if (DEBUG_LEVEL >= 3) {
-                if (message->f_port == 1) {
-                    switch (message->type) {
-                        case 1:
-                            printf("sending internal temperature: %d °C (0x%02x)... ", message->content[0], message->content[0]);
-                            break;
-
-                        case 2:
-                            printf("sending top door status: %d... ", message->content[0]);
-                            break;
-
-                        case 3:
-                            printf("sending bottom door status: %d... ", message->content[0]);
-                            break;
-
-                        default:
-                            printf("Unknown messsage type on f_port 1: d...", message->type);
-                            break;
-                    }
-                } else {
-                    printf("sending time sync message... ");
-                }
-            }
-
-            // send the message as a series of unsigned bytes in an unconfirmed uplink message
-            if (DEBUG_LEVEL >= 3) {
-                printf("(%d, %d, %d) ", message->header, sizeof(uint32_t) /* header length */ + message->content_length, message->f_port);
-            }
+    uint32_t header =
+        ((MESSAGE_VERSION & 0x07) << 29) |
+        ((timestamp & 0xFFFFF) << 9) |
+        (guaranteed_delivery ? 1 : 0) << 8 |
+        ((type & 0x0F) << 4) |
+        (content_length & 0x0F);
 
-            int send_result = lorawan_send_unconfirmed(message, sizeof(uint32_t) /* header length */ + message->content_length, message->f_port);
-            if (DEBUG_LEVEL >= 3) {
-                printf("(send_result = %d) ", send_result);
-            }
-            if (send_result < 0) {
-                if (DEBUG_LEVEL >= 2) {
-                    printf("lorawan_send_unconfirmed failed!!!\n");
-                }
+    // Guaranteed messages go to the flash journal so that they survive a reset
+    if (guaranteed_delivery) {
+        journal_slot = message_journal_append(f_port, priority, header, content, content_length);
+    }
 
-                failed_send_packet_count++;
-                return false;
-            }
+    insert_message_entry(f_port, priority, header, content, journal_slot);
+}
 
-            if (DEBUG_LEVEL >= 3) {
-                printf("success!\n");
-            }
+// Called by message_journal_replay() for every guaranteed message that was still
+// waiting for an ack when we reset
+void restore_message_entry(uint16_t journal_slot, uint8_t f_port, uint8_t priority, uint32_t header, const uint8_t* content) {
+    if (DEBUG_LEVEL >= 3) {
+        printf("Restoring journaled message on port %d, header = 0x%08x\n", f_port, header);
+    }
 
-            if (!message->guaranteed_delivery) {
-                cleanup_message(message);
-            }
+    // Journaled before priorities were
+    if (priority >= MESSAGE_PRIORITY_COUNT) {
+        priority = MESSAGE_PRIORITY_CONTROL;
+    }
 
-            message_sent = true;
-            failed_send_packet_count = 0;
+    insert_message_entry(f_port, priority, header, content, journal_slot);
+}
 
-            message->send_time = get_us_since_boot();
+void relocate_message_entry(uint16_t old_journal_slot, uint16_t new_journal_slot) {
+    for (int i = 0; i < MESSAGE_QUEUE_SIZE; i++) {
+        if (!is_message_entry_free(&message_pool[i]) && message_pool[i].journal_slot == old_journal_slot) {
+            message_pool[i].journal_slot = new_journal_slot;
+            return;
         }
+    }
+}
 
-        while (message_sent) {
-            // wait for up to 10 seconds for an event
-            if (DEBUG_LEVEL >= 3) {
-                printf("Listening for 10 seconds for a downlink message\n");
-            }
-            if (lorawan_process_timeout_ms(10000) == 0) {
-                // check if a downlink message was received
-                receive_length = lorawan_receive(receive_buffer, sizeof(receive_buffer) / sizeof(receive_buffer[0]), &receive_port);
-                if (receive_length >= 0) {
-                    // If the application restarts we could have a leftover time sync downlink
-                    // message being held at the gateway. If the restart happens during the initial time sync
-                    // then we can have two "gross" adjustments where we change the year by many multiples.
-                    // For example, receiving two adjustments for the date 3/2/2023 will push our clock out
-                    // to June 2046. To combat this problem, we drain any messages in the gateway when the
-                    // app first starts up. If we do happen to discard something important then it should be
-                    // retransmitted
-                    if (skip_first_received_messages) {
-                        if (DEBUG_LEVEL >= 3) {
-                            printf("Skipping buffered receive message from previous session\n");
-                        }
-                        continue;
-                    }
+//
+// Journal flash access. Flash can't be read while it's being programmed or erased,
+// so interrupts are disabled and, in dual core mode, core1 is parked in RAM for
+// the duration
+//
+void journal_flash_read(uint32_t offset, uint8_t* data, uint32_t length) {
+    memcpy(data, (const uint8_t*) (XIP_BASE + JOURNAL_OFFSET + offset), length);
+}
 
-                    if (DEBUG_LEVEL >= 3) {
-                        printf("received a %d byte message on port %d: ", receive_length, receive_port);
+void journal_flash_program(uint32_t offset, const uint8_t* data, uint32_t length) {
+#if DUAL_CORE_MODE
+    bool lockout = multicore_lockout_victim_is_initialized(1);
+    if (lockout) {
+        multicore_lockout_start_blocking();
+    }
+#endif
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_program(JOURNAL_OFFSET + offset, data, length);
+    restore_interrupts(interrupts);
+#if DUAL_CORE_MODE
+    if (lockout) {
+        multicore_lockout_end_blocking();
+    }
+#endif
+}
 
-                        for (int i = 0; i < receive_length; i++) {
-                            printf("%02x", receive_buffer[i]);
-                        }
-                        printf("\n");
-                    }
+void journal_flash_erase(uint32_t offset, uint32_t length) {
+#if DUAL_CORE_MODE
+    bool lockout = multicore_lockout_victim_is_initialized(1);
+    if (lockout) {
+        multicore_lockout_start_blocking();
+    }
+#endif
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(JOURNAL_OFFSET + offset, length);
+    restore_interrupts(interrupts);
+#if DUAL_CORE_MODE
+    if (lockout) {
+        multicore_lockout_end_blocking();
+    }
+#endif
+}
 
-                    uint32_t receive_header =
-                        (receive_buffer[3] << 24) |
-                        (receive_buffer[2] << 16) |
-                        (receive_buffer[1] << 8) |
-                        receive_buffer[0];
-                    uint8_t receive_version = (receive_header >> 29) & 0x07;
-                    uint32_t receive_timestamp = (receive_header >> 9) & 0xFFFFF;
-                    bool receive_guaranteed_delivery = ((receive_header >> 8) & 0x01 ? true : false );
-                    uint8_t receive_type = (receive_header >> 4) & 0x0F;
-                    if (DEBUG_LEVEL >= 3) {
-                        printf("receive message timestamp = %d, dow = %d, time = %d\n", receive_timestamp, receive_timestamp >> 17, receive_timestamp & 0x1FFFF);
-                    }
+const struct message_journal_flash journal_flash = {
+    .sector_count = JOURNAL_SECTOR_COUNT,
+    .read         = journal_flash_read,
+    .program      = journal_flash_program,
+    .erase        = journal_flash_erase
+};
 
-                    cleanup_message(match_message_by_header(receive_version, receive_port, receive_guaranteed_delivery, receive_type, receive_timestamp));
-
-                    uint32_t time_offset;
-                    switch (receive_port) {
-                        case 222:
-                            switch (receive_type) {
-                                case 0:
-                                    sync_time_on_timestamp(&receive_buffer[0]);
-                                    break;
-
-                                default:
-                                    if (DEBUG_LEVEL >= 1) {
-                                        printf("Unknown system message (port 222), type = %d", receive_type);
-                                    }
-                                    break;
-                            }
-                            break;
-
-                        case 1:
-                            switch (receive_type) {
-                                case 1:
-                                    // the first byte of the received message controls the on board LED
-                                    gpio_put(PICO_DEFAULT_LED_PIN, receive_buffer[0]);
-                                    break;
-                            }
-                            break;
-
-                        default:
-                            if (DEBUG_LEVEL >= 1) {
-                                printf("unknown message type ack: %d\n", receive_type);
-                            }
-                            break;
-                    }
-                }
+void create_message_entry(uint8_t f_port, enum message_priority priority, bool guaranteed_delivery, uint8_t type, uint8_t* content, uint8_t content_length) {
+    create_message_entry_at(create_message_timestamp(), f_port, priority, guaranteed_delivery, type, content, content_length);
+}
 
-                continue;
-            } else if (DEBUG_LEVEL >= 3) {
-                printf("No downlink message received\n");
-            }
+struct message_entry* match_message_by_header( uint8_t version, uint8_t receive_port, bool guaranteed_delivery, uint8_t type, uint32_t response_timestamp ) {
+    struct message_entry* match = NULL;
+    uint32_t bucket = message_index_hash(receive_port, guaranteed_delivery, type, response_timestamp);
 
-            skip_first_received_messages = false;
+    critical_section_enter_blocking(&message_queue_cri_sec);
+    while (message_index[bucket] != MESSAGE_INDEX_EMPTY) {
+        struct message_entry* current = &message_pool[message_index[bucket]];
 
+        if (message_matches(current, receive_port, guaranteed_delivery, type, response_timestamp)) {
+            match = current;
             break;
         }
 
-        message = next_message;
+        bucket = (bucket + 1) & (MESSAGE_INDEX_SIZE - 1);
     }
+    critical_section_exit(&message_queue_cri_sec);
 
-    return true;
+    return match;
 }
 
-void populate_time_sync( uint8_t* time_sync ) {
-    datetime_t current_time;
-
-    rtc_get_datetime(&current_time);
-    time_sync[0] = current_time.year / 100;
-    time_sync[1] = current_time.year % 100;
-    time_sync[2] = current_time.month;
-    time_sync[3] = current_time.day;
-    time_sync[4] = current_time.hour;
-    time_sync[5] = current_time.min;
-    time_sync[6] = current_time.sec;
+uint32_t queued_message_count() {
+    return message_queue_count;
 }
 
-void populate_time_sync_nop( uint8_t* time_sync ) {
-    for (int i = 0; i < 7; i++) {
-        time_sync[i] = 0;
+//
+// Network time
+//
+// The clock is set from the network with a DeviceTimeReq MAC command that rides
+// along with the next uplink, so a time sync never costs an uplink of its own.
+// time_synced tells the Jan 1, 2000 startup time apart from the real one.
+//
+bool time_synced = false;
+bool time_sync_requested = false;
+
+void request_time_sync( void ) {
+    if (lorawan_request_time() < 0) {
+        if (DEBUG_LEVEL >= 1) {
+            printf("failed to request the network time!!!\n");
+        }
+        return;
     }
+
+    time_sync_requested = true;
 }
 
-void sync_time( bool initialize ) {
-    datetime_t current_time;
+void apply_network_time( void ) {
+    uint32_t seconds;
+    uint16_t milliseconds;
 
-    if (initialize) {
-        // Initialize the realtime clock. We arbitrarily set it to Jan 1, 2000
-        current_time.year = 2000;
-        current_time.month = 1;
-        current_time.day = 1;
-        current_time.dotw = 6;
-        current_time.hour = 0;
-        current_time.min = 0;
-        current_time.sec = 0;
-        rtc_init();
-        rtc_set_datetime(&current_time);
-        sleep_ms(1); // Let the RTC stabiize
+    if (lorawan_receive_time(&seconds, &milliseconds) < 0) {
+        return;
     }
 
-    if (DEBUG_LEVEL >= 3) {
-        printf("sync_time called with initialize = %s\n", initialize ? "true" : "false");
+    set_local_time_us((((int64_t) seconds + TIME_ZONE_OFFSET_S) * 1000000) + (milliseconds * 1000));
+    time_synced = true;
+    time_sync_requested = false;
+
+    if (DEBUG_LEVEL >= 2) {
+        printf("Date updated to ");
+        print_local_time(get_local_time_us());
+        printf("\n");
     }
+}
 
-    while (1) {
-        // First, send the message with our current time
-        uint8_t time_sync[7];
-        populate_time_sync(&time_sync[0]);
+// A restored session is only known to be good once the network answers it. Any
+// downlink does, be it a MAC ack, a DeviceTimeAns or MAC commands alone, since the
+// network server drops uplinks whose MIC or frame counter don't check out. Called
+// at the end of every uplink cycle
+void check_restored_session( void ) {
+    if (!session_restored) {
+        return;
+    }
+
+    if (lorawan_downlink_count() > 0) {
         if (DEBUG_LEVEL >= 3) {
-            printf("calling first initialize on port 222\n");
-        }
-        create_message_entry(222, !initialize, 0, &time_sync[0], 4 + (sizeof(time_sync) / sizeof(time_sync[0])));
-
-        // If we're initializing then we want to block the sync_time call until we can set
-        // the time for the first time. Otherwise we just wait until the downlink response
-        // would normally be processed. And what if that normal processing response is lost?
-        // Oh well, we'll retry again soon as part of our regular time sync so no big deal
-        if (initialize) {
-            if (!transfer_data()) {
-                if (DEBUG_LEVEL >= 3) {
-                    printf("failed to transfer data!!!\n");
-                }
-                continue;
-            }
+            printf("Restored LoRaWAN session confirmed\n");
+        }
+        session_restored = false;
+        return;
+    }
 
-            // Wait for the server to send back a downlink with the offset
-            lorawan_process_timeout_ms(10000);
+    if (++session_check_uplinks >= SESSION_CHECK_UPLINKS) {
+        if (DEBUG_LEVEL >= 1) {
+            printf("Restored LoRaWAN session went unanswered, joining again\n");
+        }
+        session_restored = false;
+        lorawan_join();
+    }
+}
+
+//
+// Deadline scheduler
+//
+// Binary min-heap of tasks ordered by their absolute due time (in get_us_since_boot()
+// microseconds). Each task appears at most once; task_heap_position maps a task to
+// its slot in the heap so it can be rescheduled in O(log n). The main loop sleeps
+// until the earliest due time instead of waking up periodically. Only core0 touches
+// the heap.
+//
+enum scheduled_task {
+    TASK_SENSORS,
+    TASK_MESSAGE_TRANSFER,
+    TASK_DAILY_TASKS,
+    TASK_TIME_RESYNC,
+    TASK_JOURNAL_FLUSH,
+    TASK_COUNT
+};
+struct scheduled_task_entry {
+    uint64_t due_time;
+    uint8_t task;
+};
+static struct scheduled_task_entry task_heap[TASK_COUNT];
+static int8_t task_heap_position[TASK_COUNT] = { -1, -1, -1, -1, -1 };
+static uint8_t task_heap_size = 0;
+
+static void task_heap_swap( int a, int b ) {
+    struct scheduled_task_entry entry = task_heap[a];
+
+    task_heap[a] = task_heap[b];
+    task_heap[b] = entry;
+    task_heap_position[task_heap[a].task] = a;
+    task_heap_position[task_heap[b].task] = b;
+}
+
+static void task_heap_sift( int position ) {
+    while (position > 0 && task_heap[(position - 1) / 2].due_time > task_heap[position].due_time) {
+        task_heap_swap(position, (position - 1) / 2);
+        position = (position - 1) / 2;
+    }
+
+    while (1) {
+        int smallest = position;
+        int left = (2 * position) + 1;
+        int right = left + 1;
+
+        if (left < task_heap_size && task_heap[left].due_time < task_heap[smallest].due_time) {
+            smallest = left;
+        }
+        if (right < task_heap_size && task_heap[right].due_time < task_heap[smallest].due_time) {
+            smallest = right;
+        }
+        if (smallest == position) {
+            break;
+        }
+
+        task_heap_swap(position, smallest);
+        position = smallest;
+    }
+}
+
+void schedule_task( uint8_t task, uint64_t due_time ) {
+    int position = task_heap_position[task];
+
+    if (position < 0) {
+        position = task_heap_size++;
+        task_heap[position].task = task;
+        task_heap_position[task] = position;
+    }
+
+    task_heap[position].due_time = due_time;
+    task_heap_sift(position);
+}
+
+// Like schedule_task() but never pushes an already scheduled task out
+void schedule_task_no_later( uint8_t task, uint64_t due_time ) {
+    int position = task_heap_position[task];
+
+    if (position < 0 || due_time < task_heap[position].due_time) {
+        schedule_task(task, due_time);
+    }
+}
+
+uint64_t next_task_due_time( void ) {
+    return task_heap_size ? task_heap[0].due_time : UINT64_MAX;
+}
+
+int pop_due_task( uint64_t now ) {
+    if (task_heap_size == 0 || task_heap[0].due_time > now) {
+        return -1;
+    }
+
+    uint8_t task = task_heap[0].task;
+
+    task_heap_swap(0, --task_heap_size);
+    task_heap_position[task] = -1;
+    if (task_heap_size) {
+        task_heap_sift(0);
+    }
+
+    return task;
+}
+
+//
+// Retransmission
+//
+// Guaranteed delivery messages are resent until they're acked. The retry timeout
+// follows the observed ack round trip time the way TCP does (RFC 6298), from a
+// smoothed round trip time and its mean deviation. Only messages that were sent
+// once are timed so that an ack is never matched to the wrong send. Every resend
+// of a message doubles its timeout, less up to 25% jitter so that messages that
+// were queued together drift apart.
+//
+// A message that goes unacked after MESSAGE_MAX_SENDS sends is dropped. Resends
+// also share a budget of RETRY_BUDGET tokens that refills by one every
+// RETRY_BUDGET_REFILL_US, so a gateway outage costs a bounded amount of airtime
+// while new messages keep going out.
+//
+#define MIN_RETRY_TIMEOUT_S 60
+#define MAX_RETRY_TIMEOUT_S 21600
+#define MESSAGE_MAX_SENDS 8
+#define RETRY_BUDGET 16
+#define RETRY_BUDGET_REFILL_US 300000000
+
+static bool ack_rtt_sampled = false;
+static uint32_t ack_rtt_smoothed = 0; // seconds, scaled by 8
+static uint32_t ack_rtt_variance = 0; // seconds, scaled by 4
+static uint32_t retry_timeout_s = MESSAGE_TIMEOUT_US / 1000000;
+static uint32_t retry_tokens = RETRY_BUDGET;
+static uint64_t retry_tokens_time = 0;
+
+void sample_ack_rtt( uint32_t rtt_s ) {
+    if (!ack_rtt_sampled) {
+        ack_rtt_smoothed = rtt_s << 3;
+        ack_rtt_variance = rtt_s << 1;
+        ack_rtt_sampled = true;
+    } else {
+        int32_t delta = (int32_t) rtt_s - (int32_t) (ack_rtt_smoothed >> 3);
+        ack_rtt_smoothed += delta;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        ack_rtt_variance += delta - (int32_t) (ack_rtt_variance >> 2);
+    }
+
+    retry_timeout_s = (ack_rtt_smoothed >> 3) + ack_rtt_variance;
+    if (retry_timeout_s < MIN_RETRY_TIMEOUT_S) {
+        retry_timeout_s = MIN_RETRY_TIMEOUT_S;
+    } else if (retry_timeout_s > MAX_RETRY_TIMEOUT_S) {
+        retry_timeout_s = MAX_RETRY_TIMEOUT_S;
+    }
+
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_ACK_RTT, rtt_s, ack_rtt_smoothed >> 3, retry_timeout_s);
+    }
+}
+
+uint32_t message_retry_timeout_s( const struct message_entry* message ) {
+    uint32_t timeout = retry_timeout_s;
+
+    for (int i = 1; i < message->send_count && timeout < MAX_RETRY_TIMEOUT_S; i++) {
+        timeout <<= 1;
+    }
+    if (timeout > MAX_RETRY_TIMEOUT_S) {
+        timeout = MAX_RETRY_TIMEOUT_S;
+    }
+
+    // The jitter is a hash of the header and send count rather than a random number
+    // so that the due time doesn't move between checks
+    uint32_t hash = (message->header ^ (message->send_count * 0x9E3779B9)) * 0x9E3779B9;
+
+    return timeout - (uint32_t) (((uint64_t) (timeout / 4) * (hash >> 16)) >> 16);
+}
+
+void refill_retry_tokens() {
+    uint64_t now = get_us_since_boot();
+
+    while (retry_tokens < RETRY_BUDGET && now - retry_tokens_time >= RETRY_BUDGET_REFILL_US) {
+        retry_tokens++;
+        retry_tokens_time += RETRY_BUDGET_REFILL_US;
+    }
+    if (retry_tokens >= RETRY_BUDGET) {
+        retry_tokens_time = now;
+    }
+}
+
+// When the message can next be sent, in get_us_since_boot() time
+uint64_t message_due_time( struct message_entry* message ) {
+    if (message->send_count == 0) {
+        return 0;
+    }
+
+    uint64_t due_time = ((uint64_t) message->send_time + message_retry_timeout_s(message)) * 1000000;
+
+    // Out of retry budget, wait for the next token
+    if (retry_tokens == 0 && due_time < retry_tokens_time + RETRY_BUDGET_REFILL_US) {
+        due_time = retry_tokens_time + RETRY_BUDGET_REFILL_US;
+    }
+
+    return due_time;
+}
+
+bool is_message_due( struct message_entry* message ) {
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_MESSAGE_DUE, message->send_count, message->send_time, get_us_since_boot() / 1000000 - message->send_time);
+    }
+
+    return get_us_since_boot() >= message_due_time(message);
+}
+
+//
+// Uplink aggregation
+//
+// Queued messages that are due and share an f_port are packed back to back into
+// a single frame, as many as fit in the maximum payload for the current datarate.
+// Each record is the 4 byte header followed by content_length bytes of content, so
+// the header is enough to find the start of the next record. A frame holding a
+// single record is identical to the unaggregated format.
+//
+// Unguaranteed messages are never acked, so when the frame starts with one, it and
+// the following unguaranteed messages of the same type and length are packed into
+// a single version MESSAGE_SERIES_VERSION record (see message_series.c) whenever
+// that is smaller than sending them one record each.
+//
+#define MAX_FRAME_PAYLOAD_SIZE 242
+#define MIN_FRAME_PAYLOAD_SIZE 11 // DR0, see the note at the top of this file
+
+bool is_series_candidate( struct message_entry* message, struct message_entry* first ) {
+    return !message_guaranteed_delivery(message) &&
+           (message->f_port == first->f_port) &&
+           (message_type(message) == message_type(first)) &&
+           (message_content_length(message) == message_content_length(first));
+}
+
+int pack_series( uint8_t* frame, uint8_t* frame_length, int max_payload_size, struct message_entry* first, struct message_entry** packed ) {
+    struct message_series_encoder series;
+    int packed_count = 0;
+
+    // The series is encoded in place behind the header. If it doesn't pay off the
+    // caller packs plain records over it, since it only tries on an empty frame
+    if (!is_series_candidate(first, first) ||
+        !message_series_encoder_init(&series, &frame[sizeof(uint32_t)], max_payload_size - sizeof(uint32_t),
+            message_timestamp(first), &first->content[0], message_content_length(first))) {
+        return 0;
+    }
+    packed[packed_count++] = first;
+
+    // Unguaranteed messages have never been sent, so they're always due
+    for (struct message_entry* message = message_next(first); message != NULL; message = message_next(message)) {
+        if (!is_series_candidate(message, first)) {
+            continue;
+        }
+
+        if (!message_series_encoder_append(&series, message_timestamp(message), &message->content[0])) {
+            break;
+        }
+        packed[packed_count++] = message;
+    }
+
+    uint8_t series_length = message_series_encoder_length(&series);
+    if (packed_count < 2 ||
+        sizeof(uint32_t) + series_length >= packed_count * (sizeof(uint32_t) + message_content_length(first))) {
+        return 0;
+    }
+
+    // Same timestamp and type as the first message, content_length counts 4 byte words
+    uint32_t header =
+        ((MESSAGE_SERIES_VERSION & 0x07) << 29) |
+        (first->header & 0x1FFFFFF0) |
+        ((series_length / 4) & 0x0F);
+
+    memcpy(&frame[0], &header, sizeof(uint32_t));
+    *frame_length = sizeof(uint32_t) + series_length;
+
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_PACK_SERIES, packed_count, message_type(first), *frame_length);
+    }
+
+    return packed_count;
+}
+
+// Never sent messages are queued oldest first, so the expired ones are at the front
+void expire_messages( void ) {
+    uint32_t now_s = get_us_since_boot() / 1000000;
+    struct message_entry* next = NULL;
+
+    for (int i = 0; i < MESSAGE_PRIORITY_COUNT; i++) {
+        if (message_max_age_s[i] == 0) {
+            continue;
+        }
+
+        for (struct message_entry* message = message_queues[i]; message != NULL; message = next) {
+            next = message_next(message);
+
+            if (message->send_count > 0) {
+                continue;
+            }
+            if (now_s - message->send_time < message_max_age_s[i]) {
+                break;
+            }
 
-            // Go pick up the new timestamp
-            populate_time_sync_nop(&time_sync[0]);
             if (DEBUG_LEVEL >= 3) {
-                printf("calling second initialize on port 222\n");
+                trace(TRACE_MESSAGE_EXPIRED, message->f_port, message->header, now_s - message->send_time);
+            }
+            cleanup_message(message);
+        }
+    }
+}
+
+int pack_messages( uint8_t* frame, uint8_t* frame_length, uint8_t* f_port, struct message_entry** packed ) {
+    int max_payload_size = lorawan_max_payload_size();
+    int packed_count = 0;
+    uint8_t length = 0;
+    uint64_t next_due_time = UINT64_MAX;
+    struct message_entry* series_first = NULL;
+    int series_remaining = 0;
+    uint32_t resend_count = 0;
+    struct message_entry* next = NULL;
+
+    if (max_payload_size < MIN_FRAME_PAYLOAD_SIZE) {
+        max_payload_size = MIN_FRAME_PAYLOAD_SIZE;
+    }
+
+    refill_retry_tokens();
+    expire_messages();
+
+    // next is read up front since a message that's out of sends is dropped in the loop
+    for (int i = 0; i < MESSAGE_PRIORITY_COUNT; i++) {
+        for (struct message_entry* message = message_queues[i]; message != NULL; message = next) {
+            next = message_next(message);
+            uint8_t record_length = sizeof(uint32_t) /* header length */ + message_content_length(message);
+
+            if ((packed_count > 0) && (message->f_port != *f_port)) {
+                continue;
+            }
+
+            // pack_series() takes the first candidates in queue order, skip them here
+            if (series_remaining > 0 && is_series_candidate(message, series_first)) {
+                series_remaining--;
+                continue;
             }
-            create_message_entry(222, false, 0, &time_sync[0], 4 + (sizeof(time_sync) / sizeof(time_sync[0])));
-            if (!transfer_data()) {
-                if (DEBUG_LEVEL >= 3) {
-                    printf("failed to transfer data!!!\n");
+
+            if (packed_count == 0) {
+                packed_count = pack_series(&frame[0], &length, max_payload_size, message, &packed[0]);
+                if (packed_count > 0) {
+                    *f_port = message->f_port;
+                    series_first = message;
+                    series_remaining = packed_count - 1;
+                    continue;
                 }
+            }
+
+            if (length + record_length > max_payload_size) {
                 continue;
             }
 
-            // Check to see if our clock was adjusted beyond its initial value. If it was then
-            // we'll assume that the value was received correctly or that the time adjustment
-            // value was lost
-            bool rtc_ready = rtc_get_datetime(&current_time);
-            if (current_time.year > 2000) {
-                break;
+            if (!is_message_due(message)) {
+                if (message_due_time(message) < next_due_time) {
+                    next_due_time = message_due_time(message);
+                }
+                continue;
+            }
+
+            if (message->send_count >= MESSAGE_MAX_SENDS) {
+                if (DEBUG_LEVEL >= 1) {
+                    printf("Message 0x%08" PRIx32 " not acked after %d sends, dropping it\n", message->header, message->send_count);
+                }
+                cleanup_message(message);
+                continue;
+            }
+
+            if (message->send_count > 0) {
+                if (resend_count >= retry_tokens) {
+                    if (retry_tokens_time + RETRY_BUDGET_REFILL_US < next_due_time) {
+                        next_due_time = retry_tokens_time + RETRY_BUDGET_REFILL_US;
+                    }
+                    continue;
+                }
+                resend_count++;
+            }
+
+            if (DEBUG_LEVEL >= 3) {
+                trace(TRACE_PACK_MESSAGE, message->f_port, message->header,
+                    (message->content[0] << 24) | (message->content[1] << 16) | (message->content[2] << 8) | message->content[3]);
             }
 
-            // If we get here then we'll automatically retry in the while loop above
+            memcpy(&frame[length], &message->header, sizeof(uint32_t));
+            memcpy(&frame[length + sizeof(uint32_t)], &message->content[0], message_content_length(message));
+            length += record_length;
+
+            *f_port = message->f_port;
+            packed[packed_count++] = message;
+        }
+    }
+
+    *frame_length = length;
+
+    if (next_due_time != UINT64_MAX) {
+        schedule_task_no_later(TASK_MESSAGE_TRANSFER, next_due_time);
+    }
+
+    return packed_count;
+}
+
+void process_ack( uint8_t receive_port, uint8_t* receive_buffer ) {
+    uint32_t receive_header =
+        (receive_buffer[3] << 24) |
+        (receive_buffer[2] << 16) |
+        (receive_buffer[1] << 8) |
+        receive_buffer[0];
+    uint8_t receive_version = (receive_header >> 29) & 0x07;
+    uint32_t receive_timestamp = (receive_header >> 9) & 0xFFFFF;
+    bool receive_guaranteed_delivery = ((receive_header >> 8) & 0x01 ? true : false );
+    uint8_t receive_type = (receive_header >> 4) & 0x0F;
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_ACK, receive_port, receive_header, 0);
+    }
+
+    struct message_entry* message = match_message_by_header(receive_version, receive_port, receive_guaranteed_delivery, receive_type, receive_timestamp);
+    if (message == NULL) {
+        return;
+    }
+    if (message->send_count == 1) {
+        sample_ack_rtt(get_us_since_boot() / 1000000 - message->send_time);
+    }
+    cleanup_message(message);
+
+    const struct sensor_plugin* plugin = find_sensor_plugin(receive_port, receive_type);
+    if (plugin == NULL) {
+        if (DEBUG_LEVEL >= 1) {
+            printf("unknown message type ack: %d\n", receive_type);
+        }
+    } else if (plugin->on_ack != NULL) {
+        plugin->on_ack(plugin, receive_header);
+    }
+}
+
+//
+// Transfer state machine
+//
+// transfer_data_step() never blocks. It sends one (aggregated) uplink and then
+// waits in TRANSFER_WAITING_FOR_RX_WINDOWS until the MAC reports that the uplink
+// cycle is over, which for a Class A device happens as soon as the RX windows have
+// closed. Downlinks are processed whenever they show up, so the next uplink can go
+// out on the very next step instead of after a fixed listen period.
+//
+// Nothing is handed to the MAC while regional duty cycle limits keep the band
+// closed. The MAC would only hold on to the frame until then, whereas waiting
+// lets messages that are queued in the meantime still make it into the frame.
+//
+enum transfer_state {
+    TRANSFER_IDLE,
+    TRANSFER_WAITING_FOR_RX_WINDOWS
+};
+enum transfer_state transfer_state = TRANSFER_IDLE;
+uint64_t uplink_cycle_start_time = 0;
+uint64_t uplink_cycle_timeout = UPLINK_CYCLE_TIMEOUT_US;
+
+// lorawan_tx_commit() failures in a row back off from one second up to
+// five minutes instead of retrying on every step
+#define SEND_RETRY_MIN_US 1000000
+#define SEND_RETRY_MAX_US 300000000
+int failed_send_packet_count = 0;
+uint64_t send_retry_time = 0;
+
+// Set by on_uplink_done() once the MAC is finished with the uplink in flight
+volatile bool uplink_done = false;
+
+// Headers of the guaranteed messages in the uplink in flight. With CONFIRMED_UPLINKS
+// the MAC ack stands in for the server echoing each of them
+static uint32_t uplink_guaranteed_headers[MAX_FRAME_PAYLOAD_SIZE / sizeof(uint32_t)];
+static uint8_t uplink_guaranteed_count = 0;
+static uint8_t uplink_f_port = 0;
+
+// Unguaranteed messages in the uplink in flight. They stay queued until the MAC
+// says whether the frame went out, and are released or left for the next uplink
+// then. The header tells whether the entry still holds the same message, it may
+// have been evicted and reused in the meantime.
+static struct message_entry* uplink_unguaranteed[MAX_FRAME_PAYLOAD_SIZE / sizeof(uint32_t)];
+static uint32_t uplink_unguaranteed_headers[MAX_FRAME_PAYLOAD_SIZE / sizeof(uint32_t)];
+static uint8_t uplink_unguaranteed_count = 0;
+
+void release_uplink_messages( bool sent ) {
+    for (int i = 0; i < uplink_unguaranteed_count; i++) {
+        struct message_entry* message = uplink_unguaranteed[i];
+
+        if (is_message_entry_free(message) || message->header != uplink_unguaranteed_headers[i]) {
+            continue;
+        }
+
+        if (sent) {
+            cleanup_message(message);
         } else {
-            break;
+            schedule_task_no_later(TASK_MESSAGE_TRANSFER, message_due_time(message));
         }
     }
+    uplink_unguaranteed_count = 0;
 }
 
-void service_messages() {
-    datetime_t current_time;
-    uint64_t last_temperature_send_time = get_us_since_boot() - TEMPERATURE_READING_TIMEOUT_US;
+void on_uplink_done( const struct lorawan_tx_status* status, void* context ) {
+    uplink_done = true;
 
-    bool rejoin = false;
-    // loop forever
-    while (1) {
-        bool rtc_ready = rtc_get_datetime(&current_time);
-        if (DEBUG_LEVEL >= 3) {
-            printf("(%d) current time: %04d-%02d-%02d %02d:%02d:%02d, queued message count: %d\n",
-                rtc_ready,
-                current_time.year,
-                current_time.month,
-                current_time.day,
-                current_time.hour,
-                current_time.min,
-                current_time.sec,
-                queued_message_count()
-            );
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_UPLINK_DONE, status->result, status->datarate, status->uplink_counter);
+        if (status->confirmed) {
+            trace(TRACE_UPLINK_ACK, status->nb_trans, status->ack_received, uplink_guaranteed_count);
+        }
+    }
+
+    if (status->confirmed && status->ack_received) {
+        for (int i = 0; i < uplink_guaranteed_count; i++) {
+            uint32_t header = uplink_guaranteed_headers[i];
+            uint8_t echo[4] = { header & 0xFF, (header >> 8) & 0xFF, (header >> 16) & 0xFF, header >> 24 };
+
+            process_ack(uplink_f_port, &echo[0]);
         }
+    }
+    uplink_guaranteed_count = 0;
+
+    // A confirmed uplink that drew no ack still went out, so only a frame that
+    // was never transmitted keeps its unguaranteed messages for the next uplink
+    release_uplink_messages(status->result == LORAWAN_TX_OK ||
+                            (status->result == LORAWAN_TX_ERROR && status->nb_trans > 0));
 
-        transfer_data();
+    if (status->result == LORAWAN_TX_PAYLOAD_DROPPED && DEBUG_LEVEL >= 1) {
+        printf("MAC commands left no room for the uplink payload, only they went out\n");
+    } else if (status->result == LORAWAN_TX_ERROR && DEBUG_LEVEL >= 1) {
+        printf("Uplink failed, MAC status %d\n", status->mac_status);
+    }
+}
+
+void receive_downlinks( void ) {
+    int receive_length = 0;
+    uint8_t receive_buffer[242];
+    struct lorawan_rx_info receive_info;
+
+    // drain every downlink that was queued since the last step
+    while ((receive_length = lorawan_receive_info(receive_buffer, sizeof(receive_buffer) / sizeof(receive_buffer[0]), &receive_info)) >= 0) {
+        uint8_t receive_port = receive_info.app_port;
 
-        // now sleep for 10 seconds
         if (DEBUG_LEVEL >= 3) {
-            printf("Sleeping for 10 seconds...");
+            // Only the bytes that were actually received, a short downlink
+            // leaves the rest of the buffer untouched
+            uint32_t first_bytes = 0;
+            for (int i = 0; i < (int) sizeof(first_bytes) && i < receive_length; i++) {
+                first_bytes |= (uint32_t) receive_buffer[i] << (24 - 8 * i);
+            }
+            trace(TRACE_RECEIVE, receive_length, receive_port, first_bytes);
+            trace(TRACE_RECEIVE_INFO, receive_info.rssi, receive_info.snr, receive_info.downlink_counter);
+        }
+        if (receive_info.dropped && DEBUG_LEVEL >= 1) {
+            printf("Downlink queue overflowed, %d downlinks dropped\n", receive_info.dropped);
         }
-        for (int i = 0; i < 10; i++) {
-            if (get_us_since_boot() - last_temperature_send_time >= TEMPERATURE_READING_TIMEOUT_US) {
-                // get the internal temperature
-                uint8_t adc_temperature_byte = internal_temperature_get();
-                uint8_t content_length = sizeof(adc_temperature_byte);
 
-                if (DEBUG_LEVEL >= 2) {
-                    printf("\nWriting temperature to message queue\n");
-                }
-                create_message_entry(1, false, 1, &adc_temperature_byte, content_length);
+        if (receive_port == LED_COMMAND_PORT) {
+            // the first byte of the received message controls the on board LED
+            if (receive_length > 0) {
+                gpio_put(PICO_DEFAULT_LED_PIN, receive_buffer[0]);
+            }
+            continue;
+        }
 
-                last_temperature_send_time += TEMPERATURE_READING_TIMEOUT_US;
-                //$ last_temperature_send_time += get_us_since_boot();
+        // Acks come back on the port of the messages they ack, as a whole number
+        // of 4 byte headers. Anything else isn't an ack and must not be matched
+        // against the queue.
+        if (!is_sensor_port(receive_port) || receive_length == 0 || receive_length % sizeof(uint32_t) != 0) {
+            if (DEBUG_LEVEL >= 1) {
+                printf("Ignoring a %d byte downlink on port %d\n", receive_length, receive_port);
             }
+            continue;
+        }
 
-            if (DEBUG_LEVEL >= 3) {
-                printf(".");
+        // A downlink may carry several 4 byte headers back to back so that one
+        // downlink can ack every message in an aggregated uplink
+        for (int offset = 0; offset + (int) sizeof(uint32_t) <= receive_length; offset += sizeof(uint32_t)) {
+            process_ack(receive_port, &receive_buffer[offset]);
+        }
+    }
+}
+
+bool transfer_data_step() {
+    uint8_t* frame = NULL;
+    struct message_entry* packed[MAX_FRAME_PAYLOAD_SIZE / sizeof(uint32_t)];
+    uint8_t frame_length = 0;
+    uint8_t f_port = 0;
+
+    receive_downlinks();
+
+    if (transfer_state == TRANSFER_WAITING_FOR_RX_WINDOWS) {
+        if (!uplink_done) {
+            if (get_us_since_boot() - uplink_cycle_start_time < uplink_cycle_timeout) {
+                return true;
             }
-            lorawan_process_timeout_ms(1000);
+
+            if (DEBUG_LEVEL >= 1) {
+                printf("Uplink cycle did not complete, giving up on it\n");
+            }
+
+            // Whether the frame went out is anyone's guess, don't send its
+            // messages twice
+            release_uplink_messages(true);
         }
 
-        if (DEBUG_LEVEL >= 3) {
-            printf("\n");
+        // The RX windows have closed, so any DeviceTimeAns has been processed by now.
+        // A DeviceTimeReq only rides along with a single uplink, ask again if that
+        // one went unanswered
+        apply_network_time();
+        if (time_sync_requested) {
+            request_time_sync();
         }
+        check_restored_session();
+        transfer_state = TRANSFER_IDLE;
+    }
+
+    if (get_us_since_boot() < send_retry_time) {
+        return true;
+    }
+
+    // Nothing goes out while check_restored_session() has us joining again,
+    // LmHandlerSend() would only restart the join
+    if (!lorawan_is_joined()) {
+        return true;
+    }
+
+    // Since we're a Class A device, if we send no uplinks then we get no downlinks either
+    if (message_queue_count == 0 || lorawan_is_busy()) {
+        return true;
+    }
+
+    int duty_cycle_wait_ms = lorawan_duty_cycle_wait_ms();
+    if (duty_cycle_wait_ms > 0) {
+        schedule_task_no_later(TASK_MESSAGE_TRANSFER, get_us_since_boot() + duty_cycle_wait_ms * 1000ULL);
+        return true;
+    }
+
+    // Messages are packed straight into the library's application data buffer
+    frame = lorawan_tx_reserve(MAX_FRAME_PAYLOAD_SIZE);
+    if (frame == NULL) {
+        return true;
+    }
+
+    int packed_count = pack_messages(&frame[0], &frame_length, &f_port, &packed[0]);
+    if (packed_count == 0) {
+        return true;
+    }
+
+    // send the messages as a series of unsigned bytes, in a confirmed uplink message
+    // if CONFIRMED_UPLINKS is set and there are guaranteed messages among them
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_SEND, packed_count, frame_length, f_port);
+    }
+
+    uplink_guaranteed_count = 0;
+    uplink_unguaranteed_count = 0;
+    uplink_f_port = f_port;
+    for (int i = 0; i < packed_count; i++) {
+        if (!message_guaranteed_delivery(packed[i])) {
+            uplink_unguaranteed[uplink_unguaranteed_count] = packed[i];
+            uplink_unguaranteed_headers[uplink_unguaranteed_count++] = packed[i]->header;
+        } else if (CONFIRMED_UPLINKS) {
+            uplink_guaranteed_headers[uplink_guaranteed_count++] = packed[i]->header;
+        }
+    }
+
+    uplink_done = false;
+    int send_result = lorawan_tx_commit(frame_length, f_port,
+                                        uplink_guaranteed_count > 0 ? LORAWAN_SEND_CONFIRMED : 0, on_uplink_done, NULL);
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_SEND_RESULT, send_result, 0, 0);
+    }
+    if (send_result < 0) {
+        if (DEBUG_LEVEL >= 2) {
+            printf("lorawan_tx_commit failed!!!\n");
+        }
+        uplink_guaranteed_count = 0;
+        uplink_unguaranteed_count = 0;
+
+        // Refused by the duty cycle limits, which says exactly how long to wait
+        duty_cycle_wait_ms = lorawan_duty_cycle_wait_ms();
+        if (duty_cycle_wait_ms > 0) {
+            send_retry_time = get_us_since_boot() + duty_cycle_wait_ms * 1000ULL;
+            schedule_task_no_later(TASK_MESSAGE_TRANSFER, send_retry_time);
+            return false;
+        }
+
+        uint64_t backoff = SEND_RETRY_MIN_US << (failed_send_packet_count < 9 ? failed_send_packet_count : 9);
+        if (backoff > SEND_RETRY_MAX_US) {
+            backoff = SEND_RETRY_MAX_US;
+        }
+        failed_send_packet_count++;
+        send_retry_time = get_us_since_boot() + backoff;
+        schedule_task_no_later(TASK_MESSAGE_TRANSFER, send_retry_time);
+
+        if (DEBUG_LEVEL >= 1 && failed_send_packet_count == 6) {
+            printf("More than five failed lorawan_tx_commit() calls in a row, backing off\n");
+        }
+        return false;
+    }
+
+    failed_send_packet_count = 0;
+
+    // Unguaranteed messages are released by on_uplink_done()
+    for (int i = 0; i < packed_count; i++) {
+        if (message_guaranteed_delivery(packed[i])) {
+            if (packed[i]->send_count > 0 && retry_tokens > 0) {
+                retry_tokens--;
+            }
+            if (packed[i]->send_count < UINT8_MAX) {
+                packed[i]->send_count++;
+            }
+            packed[i]->send_time = get_us_since_boot() / 1000000;
+            schedule_task_no_later(TASK_MESSAGE_TRANSFER, message_due_time(packed[i]));
+        }
+    }
+
+    // The MAC may still delay the frame, e.g. for a retransmission it owes, so
+    // allow for that as well as for the time on air
+    int air_time_ms = lorawan_time_on_air_ms(frame_length);
+    duty_cycle_wait_ms = lorawan_duty_cycle_wait_ms();
+    if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_AIR_TIME, air_time_ms, duty_cycle_wait_ms, 0);
+    }
+
+    uplink_cycle_start_time = get_us_since_boot();
+    uplink_cycle_timeout = UPLINK_CYCLE_TIMEOUT_US + (duty_cycle_wait_ms + (air_time_ms > 0 ? air_time_ms : 0)) * 1000ULL;
+    transfer_state = TRANSFER_WAITING_FOR_RX_WINDOWS;
+    schedule_task_no_later(TASK_MESSAGE_TRANSFER, uplink_cycle_start_time + uplink_cycle_timeout);
+
+    return true;
+}
+
+void sync_time( bool initialize ) {
+    if (initialize) {
+        // Start the clock. We arbitrarily set it to Jan 1, 2000
+        critical_section_init(&epoch_cri_sec);
+        set_local_time_us(EPOCH_2000_S * 1000000ULL);
+    }
+
+    if (DEBUG_LEVEL >= 3) {
+        printf("sync_time called with initialize = %s\n", initialize ? "true" : "false");
     }
+
+    // Goes out with the next uplink, apply_network_time() picks up the answer
+    request_time_sync();
 }
 
-bool scheduled_daily_tasks( repeating_timer_t* time_sync_timer ) {
-    //$ printf("skipping scheduled_daily_tasks");
+//
+// Sensor ring
+//
+// Lock-free single-producer/single-consumer ring of fixed-size sensor records.
+// In dual core mode core1 is the only producer and core0 is the only consumer.
+// The producer only ever writes sensor_ring_head and the consumer only ever
+// writes sensor_ring_tail, so no critical section is needed; the memory barriers
+// make sure that a record is visible before the index that publishes it.
+//
+struct sensor_record {
+    uint32_t timestamp;
+    uint8_t f_port;
+    uint8_t priority;
+    bool guaranteed_delivery;
+    uint8_t type;
+    uint8_t content_length;
+    uint8_t content[7];
+};
+static struct sensor_record sensor_ring[SENSOR_RING_SIZE];
+static volatile uint32_t sensor_ring_head = 0;
+static volatile uint32_t sensor_ring_tail = 0;
+static volatile uint32_t sensor_ring_dropped = 0;
+static uint32_t sensor_ring_high_water = 0; // written by the producer only
+
+bool sensor_ring_push( uint8_t f_port, enum message_priority priority, bool guaranteed_delivery, uint8_t type, uint8_t* content, uint8_t content_length ) {
+    uint32_t head = sensor_ring_head;
+
+    if (head - sensor_ring_tail >= SENSOR_RING_SIZE) {
+        sensor_ring_dropped++;
+        return false;
+    }
+
+    struct sensor_record* record = &sensor_ring[head & (SENSOR_RING_SIZE - 1)];
+    if (content_length > sizeof(record->content)) {
+        content_length = sizeof(record->content);
+    }
+    record->timestamp = create_message_timestamp();
+    record->f_port = f_port;
+    record->priority = priority;
+    record->guaranteed_delivery = guaranteed_delivery;
+    record->type = type;
+    record->content_length = content_length;
+    memcpy(&record->content[0], content, content_length);
+
+    __dmb();
+    sensor_ring_head = head + 1;
+    __sev(); // Wake core0 if it's waiting for an event
+
+    if (head + 1 - sensor_ring_tail > sensor_ring_high_water) {
+        sensor_ring_high_water = head + 1 - sensor_ring_tail;
+    }
+
     return true;
+}
 
-    datetime_t current_time;
-    uint8_t expired_dow;
-    struct message_entry* current = message_queue;
+bool sensor_ring_pop( struct sensor_record* record ) {
+    uint32_t tail = sensor_ring_tail;
 
+    if (tail == sensor_ring_head) {
+        return false;
+    }
 
-    // Walk the list of unacknowledged messages, looking for those that are expired.
-    // We don't need to worry about new messages showing up on the message queue
-    // since new messsages always appear at the head of the queue. We do, however,
-    // need to worry about deleting messages in the list since in theory we could get
-    // an ACK back on a message at the same time that we are about to delete it. The
-    // probablility of this happening is extremely slim, however, so we'll just
-    // let the watchdog deal with this case for now
-    if (DEBUG_LEVEL >= 2) {
-        printf("Cleaning up dead messages\n");
+    __dmb();
+    memcpy(record, &sensor_ring[tail & (SENSOR_RING_SIZE - 1)], sizeof(*record));
+    __dmb();
+    sensor_ring_tail = tail + 1;
+
+    return true;
+}
+
+void drain_sensor_ring( void ) {
+    struct sensor_record record;
+
+    while (sensor_ring_pop(&record)) {
+        create_message_entry_at(record.timestamp, record.f_port, record.priority, record.guaranteed_delivery, record.type, &record.content[0], record.content_length);
+    }
+
+    if (sensor_ring_dropped && DEBUG_LEVEL >= 1) {
+        printf("Sensor ring overflowed, %d records dropped\n", sensor_ring_dropped);
+        sensor_ring_dropped = 0;
+    }
+}
+
+//
+// Temperature aggregation
+//
+// Every sample is folded into a window that keeps the count, min, max, sum and sum
+// of squares in tenths of a degree. When the window closes it is sent as a single
+// summary message, but only if the mean moved by at least TEMPERATURE_REPORT_DELTA
+// since the last report or TEMPERATURE_HEARTBEAT_US has gone by. A sample that is
+// TEMPERATURE_ALERT_DELTA away from the last report, or that crosses one of the
+// alert thresholds, closes the window early so the change goes out right away.
+//
+// Summary message content (f_port 1, type 4), big-endian:
+//   mean (int16, tenths of a degree)
+//   min (int16, tenths of a degree)
+//   max (int16, tenths of a degree)
+//   standard deviation (uint8, tenths of a degree, 255 = 25.5 or more)
+//
+struct temperature_window {
+    uint64_t start_time;
+    uint16_t count;
+    int16_t min;
+    int16_t max;
+    int32_t sum;
+    int64_t sum_of_squares;
+};
+static struct temperature_window temperature_window = { 0 };
+static bool temperature_sampled = false;
+static int16_t temperature_last_sample = 0;
+static bool temperature_reported = false;
+static int16_t temperature_reported_mean = 0;
+static uint64_t temperature_reported_time = 0;
+static uint8_t temperature_summary[7];
+
+uint32_t integer_sqrt( uint64_t value ) {
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while (bit > value) {
+        bit >>= 2;
     }
-    rtc_get_datetime(&current_time);
-    expired_dow = (current_time.dotw + 2) % 7;
-    while (current != NULL) {
-        if (expired_dow == current->dow) {
-            cleanup_message(current);
+
+    while (bit) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
         }
+        bit >>= 2;
+    }
+
+    return root;
+}
 
-        current = current->next;
+bool is_temperature_alert( int16_t temperature ) {
+    if (temperature_reported &&
+        abs(temperature - temperature_reported_mean) >= TEMPERATURE_ALERT_DELTA) {
+        return true;
     }
 
+    return temperature_sampled &&
+           (((temperature_last_sample >= TEMPERATURE_ALERT_HIGH) != (temperature >= TEMPERATURE_ALERT_HIGH)) ||
+            ((temperature_last_sample <= TEMPERATURE_ALERT_LOW) != (temperature <= TEMPERATURE_ALERT_LOW)));
+}
+
+void add_temperature_sample( int16_t temperature, uint64_t now ) {
+    struct temperature_window* window = &temperature_window;
 
-    if (DEBUG_LEVEL >= 2) {
-        printf("Daily time sync\n");
+    if (window->count == 0) {
+        window->start_time = now;
+        window->min = temperature;
+        window->max = temperature;
     }
-    sync_time(false);
 
-    return true;
+    window->count++;
+    window->sum += temperature;
+    window->sum_of_squares += (int32_t) temperature * temperature;
+    if (temperature < window->min) {
+        window->min = temperature;
+    }
+    if (temperature > window->max) {
+        window->max = temperature;
+    }
+
+    temperature_sampled = true;
+    temperature_last_sample = temperature;
 }
 
-uint64_t debounce[40];
-void __not_in_flash_func(handle_gpio_irqs)( uint gpio, uint32_t events ) {
-    if (get_us_since_boot() - 1000000 < debounce[gpio]) {
-        return;
+// Returns true, with the summary in temperature_summary, if the window is to be reported
+bool close_temperature_window( uint64_t now, bool alert ) {
+    struct temperature_window* window = &temperature_window;
+    int32_t count = window->count;
+
+    if (count == 0) {
+        return false;
     }
 
-    sleep_ms(500); // Give the pin time to settle into its new state
-    //$ uint8_t content = (events & GPIO_IRQ_EDGE_RISE ? 1 : 0);
-    uint8_t content = gpio_get(gpio);
+    // mean rounded to nearest, variance = (n * sum(x^2) - sum(x)^2) / n^2
+    int16_t mean = (window->sum + (window->sum >= 0 ? count / 2 : -count / 2)) / count;
+    uint64_t variance = ((count * window->sum_of_squares) - ((int64_t) window->sum * window->sum)) / (count * count);
+    uint32_t deviation = integer_sqrt(variance);
+
+    bool report = alert ||
+                  !temperature_reported ||
+                  abs(mean - temperature_reported_mean) >= TEMPERATURE_REPORT_DELTA ||
+                  now - temperature_reported_time >= TEMPERATURE_HEARTBEAT_US;
+
+    if (report) {
+        temperature_summary[0] = (uint16_t) mean >> 8;
+        temperature_summary[1] = (uint16_t) mean & 0xFF;
+        temperature_summary[2] = (uint16_t) window->min >> 8;
+        temperature_summary[3] = (uint16_t) window->min & 0xFF;
+        temperature_summary[4] = (uint16_t) window->max >> 8;
+        temperature_summary[5] = (uint16_t) window->max & 0xFF;
+        temperature_summary[6] = deviation > 255 ? 255 : deviation;
+
+        if (DEBUG_LEVEL >= 2) {
+            trace(TRACE_TEMPERATURE_SUMMARY, mean, window->min, window->max);
+        }
 
-    if (DEBUG_LEVEL >= 3) {
-        printf("gpio: %d, content: %d\n", gpio, content);
+        temperature_reported = true;
+        temperature_reported_mean = mean;
+        temperature_reported_time = now;
+    } else if (DEBUG_LEVEL >= 3) {
+        trace(TRACE_TEMPERATURE_UNCHANGED, mean, count, 0);
     }
 
-    debounce[gpio] = get_us_since_boot();
+    window->count = 0;
+    window->sum = 0;
+    window->sum_of_squares = 0;
 
-    switch (gpio) {
-        case 0:
-            create_message_entry(1, true, 2, &content, 1);
+    return report;
+}
+
+void init_temperature_sensor( const struct sensor_plugin* plugin ) {
+    internal_temperature_init();
+}
+
+uint64_t sample_temperature( const struct sensor_plugin* plugin, uint64_t now, bool* ready ) {
+    // get the internal temperature
+    int16_t temperature = internal_temperature_get();
+    bool alert = is_temperature_alert(temperature);
+
+    add_temperature_sample(temperature, now);
+
+    // The first sample goes out right away so that the DeviceTimeReq queued at boot
+    // gets an uplink to ride along with
+    if (alert || !temperature_reported || now - temperature_window.start_time >= TEMPERATURE_WINDOW_US) {
+        *ready = close_temperature_window(now, alert);
+    }
+
+    return now + plugin->period_us;
+}
+
+uint8_t encode_temperature_summary( const struct sensor_plugin* plugin, uint8_t* content ) {
+    memcpy(content, &temperature_summary[0], sizeof(temperature_summary));
+
+    return sizeof(temperature_summary);
+}
+
+void run_task( uint8_t task ) {
+    switch (task) {
+        case TASK_SENSORS:
+            // Nothing to do here, service_sensors() runs after every wakeup
+            break;
+
+        case TASK_MESSAGE_TRANSFER:
+            // Nothing to do here, transfer_data_step() runs after every wakeup
+            break;
+
+        case TASK_DAILY_TASKS:
+            scheduled_daily_tasks();
+            schedule_task(TASK_DAILY_TASKS, get_us_since_boot() + DAILY_TASK_TIMEOUT_US);
+            break;
+
+        case TASK_TIME_RESYNC:
+            if (DEBUG_LEVEL >= 2) {
+                printf("Daily time sync\n");
+            }
+            sync_time(false);
+            schedule_task(TASK_TIME_RESYNC, get_us_since_boot() + TIME_RESYNC_TIMEOUT_US);
             break;
 
-        case 1:
-            create_message_entry(1, true, 3, &content, 1);
+        case TASK_JOURNAL_FLUSH:
+            message_journal_flush();
             break;
     }
 }
 
+// Sleep until the next deadline, a radio event or a new sensor record (in dual
+// core mode) or GPIO edge (in single core mode), whichever comes first
+void wait_for_next_event( void ) {
+    uint64_t now = get_us_since_boot();
+    uint64_t due_time = next_task_due_time();
+    uint32_t timeout_ms = MAX_SLEEP_MS;
+
+    if (due_time <= now) {
+        timeout_ms = 0;
+    } else if ((due_time - now + 999) / 1000 < MAX_SLEEP_MS) {
+        timeout_ms = (due_time - now + 999) / 1000;
+    }
+    lorawan_process_timeout_ms_until(timeout_ms, sensor_events_pending, NULL);
+}
+
+void service_messages() {
+    uint64_t last_status_time = 0;
+
+    schedule_task(TASK_DAILY_TASKS, get_us_since_boot() + DAILY_TASK_TIMEOUT_US);
+    schedule_task(TASK_TIME_RESYNC, get_us_since_boot() + TIME_RESYNC_TIMEOUT_US);
+
+    // loop forever
+    while (1) {
+        if (DEBUG_LEVEL >= 3 && get_us_since_boot() - last_status_time >= 10000000) {
+            printf("(%d) current time: ", time_synced);
+            print_local_time(get_local_time_us());
+            printf(", queued message count: %d, ", queued_message_count());
+            report_high_water();
+            last_status_time = get_us_since_boot();
+        }
+
+        int task;
+        while ((task = pop_due_task(get_us_since_boot())) >= 0) {
+            run_task(task);
+        }
+
+#if DUAL_CORE_MODE
+        drain_sensor_ring();
+#else
+        uint64_t sensor_time = service_sensors();
+        if (sensor_time != UINT64_MAX) {
+            schedule_task(TASK_SENSORS, sensor_time);
+        }
+#endif
+
+        transfer_data_step();
+
+        // Batch journal writes, appends and tombstones that happen close together
+        // share a single page program
+        if (message_journal_is_dirty()) {
+            schedule_task_no_later(TASK_JOURNAL_FLUSH, get_us_since_boot() + JOURNAL_FLUSH_DELAY_US);
+        }
+
+        // Trace records are only formatted and written out when we're about to
+        // go idle, so logging never gets in the way of the radio
+        if (DEBUG_LEVEL > 0) {
+            trace_drain();
+        }
+
+        wait_for_next_event();
+    }
+}
+
+void scheduled_daily_tasks( void ) {
+    uint32_t now_s = get_us_since_boot() / 1000000;
+
+    // expire_messages() only runs when there's something to send and leaves the
+    // classes without a max age alone, this drops whatever unguaranteed message
+    // is still queued after MESSAGE_STALE_AGE_S. Guaranteed messages are left to
+    // the retry budget, which drops them after MESSAGE_MAX_SENDS. The age comes
+    // from send_time, so it doesn't depend on when the time was synced. It runs
+    // from the scheduler on core0, which is the only place messages are acked or
+    // removed, so nothing else can unlink a message while we walk the lists.
+    if (DEBUG_LEVEL >= 2) {
+        printf("Cleaning up dead messages\n");
+    }
+    expire_messages();
+    for (int i = 0; i < MESSAGE_PRIORITY_COUNT; i++) {
+        struct message_entry* current = message_queues[i];
+
+        while (current != NULL) {
+            struct message_entry* next = message_next(current);
+
+            if (!message_guaranteed_delivery(current) && now_s - current->send_time >= MESSAGE_STALE_AGE_S) {
+                cleanup_message(current);
+            }
+
+            current = next;
+        }
+    }
+}
+
+//
+// Door events
+//
+// The GPIO IRQ only timestamps the edge into gpio_event_ring, a lock-free ring
+// with the IRQ as its only producer and service_sensors() as its only consumer.
+// The door pins get a raw handler of their own rather than the per-core GPIO
+// callback, which in single core mode already belongs to the SX1276 DIO pins.
+// Each door is a sensor plugin that is woken up by an edge on its pin. It waits
+// until the pin has had no edges for DOOR_SETTLE_US, sleeping on the hardware
+// timer in the meantime, then samples the settled pin and queues a door message
+// if the state changed.
+//
+#define DOOR_COUNT 2
+#define DOOR_SETTLE_US 500000
+#define GPIO_EVENT_RING_SIZE 16 // must be a power of two
+
+struct gpio_event {
+    uint32_t time_us;
+    uint8_t gpio;
+};
+static struct gpio_event gpio_event_ring[GPIO_EVENT_RING_SIZE];
+static volatile uint32_t gpio_event_head = 0;
+static volatile uint32_t gpio_event_tail = 0;
+static volatile uint32_t gpio_events_dropped = 0;
+static uint32_t gpio_event_high_water = 0; // written by the IRQ only
+
+static uint32_t door_last_edge_time[DOOR_COUNT];
+static bool door_edge_pending[DOOR_COUNT];
+static uint8_t door_reported_state[DOOR_COUNT];
+
+void __not_in_flash_func(capture_gpio_irqs)( uint gpio, uint32_t events ) {
+    uint32_t head = gpio_event_head;
+
+    if (head - gpio_event_tail >= GPIO_EVENT_RING_SIZE) {
+        gpio_events_dropped++;
+        return;
+    }
+
+    gpio_event_ring[head & (GPIO_EVENT_RING_SIZE - 1)].time_us = time_us_32();
+    gpio_event_ring[head & (GPIO_EVENT_RING_SIZE - 1)].gpio = gpio;
+    __dmb();
+    gpio_event_head = head + 1;
+    if (head + 1 - gpio_event_tail > gpio_event_high_water) {
+        gpio_event_high_water = head + 1 - gpio_event_tail;
+    }
+    __sev(); // Wake up whoever runs service_sensors()
+}
+
+void __not_in_flash_func(door_gpio_irq_handler)( void ) {
+    for (uint gpio = 0; gpio < DOOR_COUNT; gpio++) {
+        uint32_t events = gpio_get_irq_event_mask(gpio) & (GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
+
+        if (events) {
+            gpio_acknowledge_irq(gpio, events);
+            capture_gpio_irqs(gpio, events);
+        }
+    }
+}
+
+void drain_gpio_events( void ) {
+    while (gpio_event_tail != gpio_event_head) {
+        uint32_t tail = gpio_event_tail;
+
+        __dmb();
+        struct gpio_event event = gpio_event_ring[tail & (GPIO_EVENT_RING_SIZE - 1)];
+        __dmb();
+        gpio_event_tail = tail + 1;
+
+        if (event.gpio < DOOR_COUNT) {
+            door_last_edge_time[event.gpio] = event.time_us;
+            door_edge_pending[event.gpio] = true;
+            wake_sensor(SENSOR_DOOR_0 + event.gpio, 0);
+        }
+    }
+
+    if (gpio_events_dropped && DEBUG_LEVEL >= 1) {
+        printf("GPIO event ring overflowed, %d events dropped\n", gpio_events_dropped);
+        gpio_events_dropped = 0;
+    }
+}
+
+// Ends the sleep in wait_for_next_event() as soon as core0 has something to pick
+// up. Both producers send an event after publishing, so it's checked on wakeup
+bool sensor_events_pending( void* context ) {
+#if DUAL_CORE_MODE
+    return sensor_ring_head != sensor_ring_tail;
+#else
+    return gpio_event_head != gpio_event_tail;
+#endif
+}
+
+void init_door_sensor( const struct sensor_plugin* plugin ) {
+    uint gpio = plugin->channel;
+
+    gpio_init(gpio);
+    gpio_set_dir(gpio, GPIO_IN);
+    gpio_pull_up(gpio);
+
+    door_edge_pending[gpio] = false;
+    door_reported_state[gpio] = gpio_get(gpio);
+
+    // One handler serves every door pin
+    static bool door_irq_handler_added = false;
+    if (!door_irq_handler_added) {
+        gpio_add_raw_irq_handler_masked((1u << DOOR_COUNT) - 1, &door_gpio_irq_handler);
+        door_irq_handler_added = true;
+    }
+    gpio_set_irq_enabled(gpio, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+uint64_t sample_door( const struct sensor_plugin* plugin, uint64_t now, bool* ready ) {
+    uint gpio = plugin->channel;
+
+    if (!door_edge_pending[gpio]) {
+        return UINT64_MAX;
+    }
+
+    uint32_t quiet_time = time_us_32() - door_last_edge_time[gpio];
+    if (quiet_time < DOOR_SETTLE_US) {
+        return now + (DOOR_SETTLE_US - quiet_time);
+    }
+
+    door_edge_pending[gpio] = false;
+
+    uint8_t state = gpio_get(gpio);
+    if (state != door_reported_state[gpio]) {
+        door_reported_state[gpio] = state;
+        *ready = true;
+
+        if (DEBUG_LEVEL >= 3) {
+            trace(TRACE_DOOR_EVENT, gpio, state, 0);
+        }
+    }
+
+    return UINT64_MAX;
+}
+
+uint8_t encode_door_state( const struct sensor_plugin* plugin, uint8_t* content ) {
+    content[0] = door_reported_state[plugin->channel];
+
+    return 1;
+}
+
+//
+// Sensor plugin registry
+//
+// Adding a sensor takes an entry here, plus a sensor_plugin_id if something
+// needs to wake it up. The scheduler, the transfer path and ack handling pick it
+// up from the table.
+//
+const struct sensor_plugin sensor_plugins[SENSOR_PLUGIN_COUNT] = {
+    [SENSOR_TEMPERATURE] = {
+        .name = "temperature",
+        .f_port = 1,
+        .type = 4,
+        .priority = MESSAGE_PRIORITY_TELEMETRY,
+        .guaranteed_delivery = false,
+        .period_us = TEMPERATURE_READING_TIMEOUT_US,
+        .init = init_temperature_sensor,
+        .sample = sample_temperature,
+        .encode = encode_temperature_summary
+    },
+    [SENSOR_DOOR_0] = {
+        .name = "door 0",
+        .f_port = 1,
+        .type = 2,
+        .priority = MESSAGE_PRIORITY_ALARM,
+        .guaranteed_delivery = true,
+        .channel = 0,
+        .init = init_door_sensor,
+        .sample = sample_door,
+        .encode = encode_door_state
+    },
+    [SENSOR_DOOR_1] = {
+        .name = "door 1",
+        .f_port = 1,
+        .type = 3,
+        .priority = MESSAGE_PRIORITY_ALARM,
+        .guaranteed_delivery = true,
+        .channel = 1,
+        .init = init_door_sensor,
+        .sample = sample_door,
+        .encode = encode_door_state
+    }
+};
+static uint64_t sensor_due_time[SENSOR_PLUGIN_COUNT];
+
+const struct sensor_plugin* find_sensor_plugin( uint8_t f_port, uint8_t type ) {
+    for (int i = 0; i < SENSOR_PLUGIN_COUNT; i++) {
+        if (sensor_plugins[i].f_port == f_port && sensor_plugins[i].type == type) {
+            return &sensor_plugins[i];
+        }
+    }
+
+    return NULL;
+}
+
+bool is_sensor_port( uint8_t f_port ) {
+    for (int i = 0; i < SENSOR_PLUGIN_COUNT; i++) {
+        if (sensor_plugins[i].f_port == f_port) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Runs on whichever core samples the sensors
+void init_sensors( void ) {
+    for (int i = 0; i < SENSOR_PLUGIN_COUNT; i++) {
+        if (sensor_plugins[i].init != NULL) {
+            sensor_plugins[i].init(&sensor_plugins[i]);
+        }
+
+        // Periodic sensors take their first sample right away
+        sensor_due_time[i] = sensor_plugins[i].period_us ? 0 : UINT64_MAX;
+    }
+}
+
+// Makes a sensor due no later than due_time (get_us_since_boot() time)
+void wake_sensor( enum sensor_plugin_id id, uint64_t due_time ) {
+    if (due_time < sensor_due_time[id]) {
+        sensor_due_time[id] = due_time;
+    }
+}
+
+void publish_sensor_message( const struct sensor_plugin* plugin ) {
+    uint8_t content[7];
+    uint8_t length = plugin->encode(plugin, &content[0]);
+
+#if DUAL_CORE_MODE
+    sensor_ring_push(plugin->f_port, plugin->priority, plugin->guaranteed_delivery, plugin->type, &content[0], length);
+#else
+    create_message_entry(plugin->f_port, plugin->priority, plugin->guaranteed_delivery, plugin->type, &content[0], length);
+#endif
+}
+
+// Samples every sensor that is due, or will be within SENSOR_BATCH_US, so that
+// independent sensors share a wakeup. Returns when service_sensors() next needs
+// to run (get_us_since_boot() time), UINT64_MAX if nothing is pending
+uint64_t service_sensors( void ) {
+    uint64_t next_due_time = UINT64_MAX;
+
+    drain_gpio_events();
+
+    uint64_t now = get_us_since_boot();
+    for (int i = 0; i < SENSOR_PLUGIN_COUNT; i++) {
+        const struct sensor_plugin* plugin = &sensor_plugins[i];
+
+        if (sensor_due_time[i] <= now + SENSOR_BATCH_US) {
+            bool ready = false;
+
+            sensor_due_time[i] = plugin->sample(plugin, now, &ready);
+            if (ready) {
+                publish_sensor_message(plugin);
+            }
+        }
+
+        if (sensor_due_time[i] < next_due_time) {
+            next_due_time = sensor_due_time[i];
+        }
+    }
+
+    return next_due_time;
+}
+
 void setup_interrupts( void ) {
-    /*
-    static struct repeating_timer time_sync_timer;
+    // Set up the sensors, along with their GPIO IRQs
+    init_sensors();
+}
+
+#if DUAL_CORE_MODE
+void core1_sensor_loop( void ) {
+    // Lets core0 park us while it writes to flash
+    multicore_lockout_victim_init();
 
-    // Schedule a time sync
-    add_repeating_timer_ms(DAILY_TASK_TIMEOUT_US / 1000, scheduled_daily_tasks, NULL, &time_sync_timer);
-    */
+    // GPIO IRQs are delivered to the core that enables them, and the sensors are
+    // only ever touched from here
+    setup_interrupts();
 
-    // Initialize our debounce array
-    for (int i = 0; i < 40; i++) {
-        debounce[i] = 0;
+    while (1) {
+        uint64_t due_time = service_sensors();
+
+        // Sleep until the next sensor is due, any GPIO interrupt wakes us up early
+        uint64_t now = get_us_since_boot();
+        if (due_time > now) {
+            best_effort_wfe_or_timeout(make_timeout_time_us(due_time - now));
+        }
     }
+}
+#endif
+
+//
+// RAM budget
+//
+// Everything sizeable is statically allocated, so the budget is settled at compile
+// time: the build fails if the queue and its rings outgrow MESSAGE_RAM_BUDGET, and
+// report_ram_budget() prints the breakdown at boot. The high-water marks show how
+// close the queue and rings have come to full since boot, and the heap high water
+// is as far as newlib's sbrk() has ever moved, since it never gives memory back.
+//
+#ifndef MESSAGE_RAM_BUDGET
+#define MESSAGE_RAM_BUDGET (16 * 1024)
+#endif
+#define MESSAGE_RAM_SIZE (sizeof(message_pool) + sizeof(free_bitmap) + sizeof(free_summary) + \
+                          sizeof(message_index) + sizeof(sensor_ring) + sizeof(gpio_event_ring))
+_Static_assert(MESSAGE_RAM_SIZE <= MESSAGE_RAM_BUDGET, "message queue doesn't fit in MESSAGE_RAM_BUDGET");
+
+uint32_t get_heap_high_water( void ) {
+    extern char __end__;
+
+    return (char*) sbrk(0) - &__end__;
+}
+
+uint32_t get_free_ram( void ) {
+    extern char __StackLimit;
 
-    // Enable our GPIO IRQs
-    gpio_init(0);
-    gpio_set_dir(0, GPIO_IN);
-    gpio_pull_up(0);
-    gpio_set_irq_enabled_with_callback(0, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &handle_gpio_irqs);
-    gpio_init(1);
-    gpio_set_dir(1, GPIO_IN);
-    gpio_pull_up(1);
-    gpio_set_irq_enabled(1, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
+    return &__StackLimit - (char*) sbrk(0);
+}
+
+void report_high_water( void ) {
+    printf("high water: queue %d, sensor ring %d, gpio ring %d, heap %d, free RAM: %d\n",
+        message_queue_high_water,
+        sensor_ring_high_water,
+        gpio_event_high_water,
+        get_heap_high_water(),
+        get_free_ram()
+    );
+}
+
+void report_ram_budget( void ) {
+    extern char __data_start__, __bss_end__;
+
+    printf("RAM: %u bytes static, %u bytes heap, %u bytes free\n",
+        (unsigned) (&__bss_end__ - &__data_start__), (unsigned) get_heap_high_water(), (unsigned) get_free_ram());
+    printf("  message pool: %u x %u bytes = %u\n", MESSAGE_QUEUE_SIZE, (unsigned) sizeof(struct message_entry), (unsigned) sizeof(message_pool));
+    printf("  free bitmaps: %u\n", (unsigned) (sizeof(free_bitmap) + sizeof(free_summary)));
+    printf("  ack index: %u\n", (unsigned) sizeof(message_index));
+    printf("  sensor ring: %u\n", (unsigned) sizeof(sensor_ring));
+    printf("  gpio event ring: %u\n", (unsigned) sizeof(gpio_event_ring));
+    printf("  total: %u of %u budgeted\n", (unsigned) MESSAGE_RAM_SIZE, (unsigned) MESSAGE_RAM_BUDGET);
 }
 
 int main( void )
@@ -897,7 +2376,7 @@ int main( void )
     // initialize stdio and wait for USB CDC connect
     stdio_init_all();
     //$ stdio_usb_init();
-    sleep_ms(5000);
+    sleep_ms(BOOT_DELAY_MS);
     //$ while (!tud_cdc_connected()) {
     //$     tight_loop_contents();
     //$ }
@@ -910,45 +2389,46 @@ int main( void )
     // below to remove any existing device info
     // erase_nvm();
 
-    critical_section_enter_blocking(&free_queue_cri_sec);
-    for (int i = 0; i < MESSAGE_QUEUE_SIZE; i++) {
-        struct message_entry* message = (struct message_entry*) malloc(sizeof(struct message_entry));
-        message->index = i;
-        message->next = free_queue;
-        free_queue = message;
+    init_message_queue();
+
+    // Bring back any guaranteed messages that were still waiting for an ack
+    if (message_journal_init(&journal_flash, relocate_message_entry) < 0) {
+        if (DEBUG_LEVEL >= 1) {
+            printf("failed to initialize the message journal!!!\n");
+        }
+    } else {
+        message_journal_replay(restore_message_entry);
+        if (DEBUG_LEVEL >= 3) {
+            printf("Restored %d journaled messages\n", queued_message_count());
+        }
     }
-    critical_section_exit(&free_queue_cri_sec);
 
     if (DEBUG_LEVEL >= 3) {
-        printf("Free heap available: %d\n", getFreeHeap());
+        report_ram_budget();
     }
 
-    // initialize the LED pin and internal temperature ADC
+    // initialize the LED pin, the sensors are set up along with the GPIO IRQs
     gpio_init(PICO_DEFAULT_LED_PIN);
     gpio_set_dir(PICO_DEFAULT_LED_PIN, GPIO_OUT);
 
-    critical_section_init(&message_queue_cri_sec);
-    critical_section_init(&free_queue_cri_sec);
-
-    internal_temperature_init();
-
     // uncomment next line to enable debug
     // lorawan_debug(true);
 
     // Join the LoRaWAN network
     join();
 
-    // Get the current date and time from the remote end
+    // Start the clock and ask the network for the current date and time
     sync_time( true );
 
-    /*
+#if DUAL_CORE_MODE
+    // Sensor sampling and GPIO capture run on core1 from here on
     if (DEBUG_LEVEL >= 3) {
-        printf("Hooking in service_interrupts - kind of\n");
+        printf("Launching core1 sensor loop\n");
     }
-    multicore_launch_core1(&service_interrupts);
-    */
-    // printf("Running setup_interrupts\n");
-    // setup_interrupts();
+    multicore_launch_core1(&core1_sensor_loop);
+#else
+    setup_interrupts();
+#endif
 
     service_messages();
 
@@ -956,28 +2436,81 @@ int main( void )
     return 1;
 }
 
+//
+// Internal temperature sensor
+//
+// Each reading captures a burst of TEMPERATURE_SAMPLE_COUNT conversions with the
+// ADC in free-running mode, moved from the ADC FIFO by DMA, and averages them.
+// The conversion from section 4.9.4 in the RP2040 datasheet
+//   https://datasheets.raspberrypi.org/rp2040/rp2040-datasheet.pdf
+//
+//   T = 27 - (V - 0.706) / 0.001721, with V = raw * 3.3 / 4095
+//
+// is linear in raw, so it's folded at compile time into a Q24 slope per unit of
+// the sample sum and a Q24 offset that give tenths of a degree with integer math
+// only (the M0+ has no FPU). The product takes 64 bits, but it's a multiply and a
+// shift, where a Q12 slope that fits 32 bits would be off by up to 0.4 tenths at
+// the top of the ADC range.
+//
+#define TEMPERATURE_SAMPLE_COUNT 16
+#define TEMPERATURE_SUM_SLOPE_Q24 ((int64_t) (3.3 * 10 / (4095 * 0.001721) / TEMPERATURE_SAMPLE_COUNT * (1 << 24) + 0.5))
+#define TEMPERATURE_OFFSET_Q24 ((int64_t) ((270 + 0.706 * 10 / 0.001721) * (1 << 24) + 0.5))
+
+// Converts the sum of TEMPERATURE_SAMPLE_COUNT raw ADC values to tenths of a
+// degree, rounding to nearest
+int16_t internal_temperature_convert(uint32_t adc_sum)
+{
+    int64_t temperature_q24 = TEMPERATURE_OFFSET_Q24 - (int64_t) adc_sum * TEMPERATURE_SUM_SLOPE_Q24;
+
+    return (temperature_q24 + (1 << 23)) >> 24;
+}
+
+static uint temperature_dma_channel;
+static dma_channel_config temperature_dma_config;
+static uint16_t temperature_samples[TEMPERATURE_SAMPLE_COUNT];
+
 void internal_temperature_init()
 {
     adc_init();
     adc_set_temp_sensor_enabled(true);
     adc_select_input(4);
+
+    // One DREQ per conversion, no error bit and full 12 bit samples in the FIFO
+    adc_fifo_setup(true, true, 1, false, false);
+    adc_set_clkdiv(0); // Back to back conversions, 2us each
+
+    temperature_dma_channel = dma_claim_unused_channel(true);
+    temperature_dma_config = dma_channel_get_default_config(temperature_dma_channel);
+    channel_config_set_transfer_data_size(&temperature_dma_config, DMA_SIZE_16);
+    channel_config_set_read_increment(&temperature_dma_config, false);
+    channel_config_set_write_increment(&temperature_dma_config, true);
+    channel_config_set_dreq(&temperature_dma_config, DREQ_ADC);
 }
 
-float internal_temperature_get()
+int16_t internal_temperature_get()
 {
-    const float v_ref = 3.3;
+    uint32_t adc_sum = 0;
 
-    // select and read the ADC
+    // select the sensor and capture a burst of samples
     adc_select_input(4);
-    uint16_t adc_raw = adc_read();
-
-    // convert the raw ADC value to a voltage
-    float adc_voltage = adc_raw * v_ref / 4095.0f;
-
-    // convert voltage to temperature, using the formula from 
-    // section 4.9.4 in the RP2040 datasheet
-    //   https://datasheets.raspberrypi.org/rp2040/rp2040-datasheet.pdf
-    float adc_temperature = 27.0 - ((adc_voltage - 0.706) / 0.001721);
+    adc_fifo_drain();
+    dma_channel_configure(
+        temperature_dma_channel,
+        &temperature_dma_config,
+        temperature_samples,
+        &adc_hw->fifo,
+        TEMPERATURE_SAMPLE_COUNT,
+        true
+    );
+    adc_run(true);
+    dma_channel_wait_for_finish_blocking(temperature_dma_channel);
+    adc_run(false);
+    adc_fifo_drain();
+
+    for (int i = 0; i < TEMPERATURE_SAMPLE_COUNT; i++) {
+        adc_sum += temperature_samples[i];
+    }
 
-    return adc_temperature;
+    // convert the summed raw ADC values to tenths of a degree
+    return internal_temperature_convert(adc_sum);
 }
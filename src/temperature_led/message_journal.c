@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Journal layout
+ *
+ * The journal region is split into sectors that are used as a ring. Each sector
+ * holds 256 fixed size 16 byte records, the first of which is a sector header
+ * carrying a sequence number so that the newest sector can be found at boot.
+ * Records are only ever appended, at the head of the newest sector. Appends are
+ * collected in a one page RAM buffer and programmed a page at a time.
+ *
+ * Removing a record (the message was acked) clears its state byte to 0x00. NOR
+ * flash can clear bits without an erase, so this is just a page program of 0xFF
+ * bytes with the state byte cleared. Tombstones are batched too.
+ *
+ * The sector after the head is always kept erased. When the head moves into a new
+ * sector the oldest sector's live records are copied forward into it and the
+ * oldest sector is erased, so each erase is amortized over a whole sector's worth
+ * of appends. A sector holds at most 255 live records and the head sector is fresh
+ * when they are copied, so they always fit, though if all of them are live there
+ * is no room left for the record being appended and it isn't journaled. A reset between copying and erasing
+ * is picked up at boot: the records that made it into the head sector are the
+ * first live records of the old sector, in order, so the copy resumes after them.
+ *
+ * At boot the head sector is found from the sector headers and the head slot by a
+ * binary search, since written records always form a prefix of the sector.
+ */
+
+#include <string.h>
+
+#include "message_journal.h"
+
+#define RECORDS_PER_PAGE (MESSAGE_JOURNAL_PAGE_SIZE / MESSAGE_JOURNAL_RECORD_SIZE)
+#define SLOTS_PER_SECTOR (MESSAGE_JOURNAL_SECTOR_SIZE / MESSAGE_JOURNAL_RECORD_SIZE)
+#define MAX_PENDING_TOMBSTONES 32
+
+#define RECORD_ERASED 0xFF
+#define RECORD_SECTOR_HEADER 0xA5
+#define RECORD_LIVE 0x5A
+#define RECORD_TOMBSTONE 0x00
+
+struct journal_record {
+    uint8_t state;
+    uint8_t f_port;
+    uint8_t content_length;
+    uint8_t check;
+    uint32_t header; // message header, or the sequence number for a sector header
+    uint8_t content[7];
+    uint8_t priority; // 0xFF in records written before priorities were journaled
+};
+
+_Static_assert(sizeof(struct journal_record) == MESSAGE_JOURNAL_RECORD_SIZE, "journal records must be 16 bytes");
+
+static const struct message_journal_flash* journal_flash = NULL;
+static message_journal_relocate_callback_t journal_on_relocate = NULL;
+
+static uint16_t head_sector = 0;
+static uint16_t head_slot = 0; // next free slot in head_sector
+static uint32_t head_sequence = 0;
+
+static uint8_t page_buffer[MESSAGE_JOURNAL_PAGE_SIZE] __attribute__((aligned(4)));
+static bool page_dirty = false;
+
+static uint16_t pending_tombstones[MAX_PENDING_TOMBSTONES];
+static uint8_t pending_tombstone_count = 0;
+
+static uint32_t slot_offset( uint16_t slot ) {
+    return (slot / SLOTS_PER_SECTOR) * MESSAGE_JOURNAL_SECTOR_SIZE + (slot % SLOTS_PER_SECTOR) * MESSAGE_JOURNAL_RECORD_SIZE;
+}
+
+static uint32_t head_page_offset( void ) {
+    return head_sector * MESSAGE_JOURNAL_SECTOR_SIZE + (head_slot / RECORDS_PER_PAGE) * MESSAGE_JOURNAL_PAGE_SIZE;
+}
+
+static uint8_t record_check( const struct journal_record* record ) {
+    const uint8_t* bytes = (const uint8_t*) record;
+    uint8_t crc = 0xFF;
+
+    // CRC-8 (polynomial 0x07) over everything except the state and check bytes,
+    // which change independently of the payload
+    for (int i = 1; i < MESSAGE_JOURNAL_RECORD_SIZE; i++) {
+        if (i == 3) {
+            continue;
+        }
+
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+static void read_record( uint16_t slot, struct journal_record* record ) {
+    journal_flash->read(slot_offset(slot), (uint8_t*) record, sizeof(*record));
+}
+
+static bool is_sector_erased( uint16_t sector ) {
+    uint8_t buffer[MESSAGE_JOURNAL_PAGE_SIZE];
+
+    for (int page = 0; page < MESSAGE_JOURNAL_SECTOR_SIZE / MESSAGE_JOURNAL_PAGE_SIZE; page++) {
+        journal_flash->read(sector * MESSAGE_JOURNAL_SECTOR_SIZE + page * MESSAGE_JOURNAL_PAGE_SIZE, buffer, sizeof(buffer));
+        for (uint32_t i = 0; i < sizeof(buffer); i++) {
+            if (buffer[i] != 0xFF) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void flush_page( void ) {
+    if (!page_dirty || head_slot >= SLOTS_PER_SECTOR) {
+        return;
+    }
+
+    journal_flash->program(head_page_offset(), page_buffer, sizeof(page_buffer));
+    page_dirty = false;
+}
+
+static void flush_tombstones( void ) {
+    uint8_t buffer[MESSAGE_JOURNAL_PAGE_SIZE];
+
+    while (pending_tombstone_count) {
+        uint32_t page_offset = slot_offset(pending_tombstones[0]) & ~(MESSAGE_JOURNAL_PAGE_SIZE - 1);
+
+        // Clear the state byte of every pending tombstone on this page in one program
+        memset(buffer, 0xFF, sizeof(buffer));
+        for (int i = 0; i < pending_tombstone_count; ) {
+            uint32_t offset = slot_offset(pending_tombstones[i]);
+
+            if ((offset & ~(MESSAGE_JOURNAL_PAGE_SIZE - 1)) == page_offset) {
+                buffer[offset & (MESSAGE_JOURNAL_PAGE_SIZE - 1)] = RECORD_TOMBSTONE;
+                pending_tombstones[i] = pending_tombstones[--pending_tombstone_count];
+            } else {
+                i++;
+            }
+        }
+
+        journal_flash->program(page_offset, buffer, sizeof(buffer));
+    }
+}
+
+static void load_head_page( void ) {
+    if (head_slot < SLOTS_PER_SECTOR) {
+        journal_flash->read(head_page_offset(), page_buffer, sizeof(page_buffer));
+    } else {
+        memset(page_buffer, 0xFF, sizeof(page_buffer));
+    }
+    page_dirty = false;
+}
+
+static void write_record( const struct journal_record* record ) {
+    memcpy(&page_buffer[(head_slot % RECORDS_PER_PAGE) * MESSAGE_JOURNAL_RECORD_SIZE], record, sizeof(*record));
+    page_dirty = true;
+
+    if ((head_slot + 1) % RECORDS_PER_PAGE == 0) {
+        flush_page();
+        head_slot++;
+        load_head_page();
+    } else {
+        head_slot++;
+    }
+}
+
+static void write_sector_header( void ) {
+    struct journal_record record;
+
+    memset(&record, 0xFF, sizeof(record));
+    record.state = RECORD_SECTOR_HEADER;
+    record.header = head_sequence;
+    record.check = record_check(&record);
+
+    head_slot = 0;
+    load_head_page();
+    write_record(&record);
+    flush_page();
+}
+
+static uint16_t append_record( uint8_t f_port, uint8_t priority, uint32_t header, const uint8_t* content, uint8_t content_length ) {
+    struct journal_record record;
+    uint16_t slot = head_sector * SLOTS_PER_SECTOR + head_slot;
+
+    memset(&record, 0xFF, sizeof(record));
+    record.state = RECORD_LIVE;
+    record.f_port = f_port;
+    record.priority = priority;
+    record.content_length = content_length;
+    record.header = header;
+    memcpy(&record.content[0], content, content_length);
+    record.check = record_check(&record);
+
+    write_record(&record);
+
+    return slot;
+}
+
+// Copy the live records of sector into the head sector and then erase it. The
+// first copied live records are already in the head sector
+static void compact_sector( uint16_t sector, uint16_t copied ) {
+    struct journal_record record;
+
+    for (uint16_t i = 1; i < SLOTS_PER_SECTOR; i++) {
+        uint16_t slot = sector * SLOTS_PER_SECTOR + i;
+        uint16_t new_slot = MESSAGE_JOURNAL_NO_SLOT;
+
+        read_record(slot, &record);
+        if (record.state == RECORD_ERASED) {
+            break;
+        }
+
+        if (record.state != RECORD_LIVE || record.check != record_check(&record)) {
+            continue;
+        }
+
+        if (copied > 0) {
+            copied--;
+            continue;
+        }
+
+        // A fresh head sector always has room, but should it ever fill up the
+        // record is only dropped from flash, its message stays queued
+        if (head_slot < SLOTS_PER_SECTOR) {
+            new_slot = append_record(record.f_port, record.priority, record.header, &record.content[0], record.content_length);
+        }
+        if (journal_on_relocate != NULL) {
+            journal_on_relocate(slot, new_slot);
+        }
+    }
+
+    flush_page();
+    journal_flash->erase(sector * MESSAGE_JOURNAL_SECTOR_SIZE, MESSAGE_JOURNAL_SECTOR_SIZE);
+}
+
+static void start_next_sector( void ) {
+    message_journal_flush();
+
+    head_sector = (head_sector + 1) % journal_flash->sector_count;
+    head_sequence++;
+    write_sector_header();
+
+    compact_sector((head_sector + 1) % journal_flash->sector_count, 0);
+}
+
+int message_journal_init( const struct message_journal_flash* flash, message_journal_relocate_callback_t on_relocate ) {
+    struct journal_record record;
+    bool found = false;
+
+    if (flash == NULL || flash->sector_count < 3) {
+        return -1;
+    }
+
+    journal_flash = flash;
+    journal_on_relocate = on_relocate;
+    pending_tombstone_count = 0;
+
+    // The newest sector is the one with the highest sequence number
+    for (uint16_t sector = 0; sector < flash->sector_count; sector++) {
+        read_record(sector * SLOTS_PER_SECTOR, &record);
+
+        if (record.state != RECORD_SECTOR_HEADER || record.check != record_check(&record)) {
+            continue;
+        }
+
+        if (!found || record.header > head_sequence) {
+            head_sector = sector;
+            head_sequence = record.header;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        // Blank or corrupt region, start from scratch
+        for (uint16_t sector = 0; sector < flash->sector_count; sector++) {
+            flash->erase(sector * MESSAGE_JOURNAL_SECTOR_SIZE, MESSAGE_JOURNAL_SECTOR_SIZE);
+        }
+
+        head_sector = 0;
+        head_sequence = 1;
+        write_sector_header();
+
+        return 0;
+    }
+
+    // Written records form a prefix of the sector, binary search for its end
+    uint16_t low = 1;
+    uint16_t high = SLOTS_PER_SECTOR;
+    while (low < high) {
+        uint16_t middle = (low + high) / 2;
+
+        read_record(head_sector * SLOTS_PER_SECTOR + middle, &record);
+        if (record.state == RECORD_ERASED) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    head_slot = low;
+    load_head_page();
+
+    // Finish a compaction that was interrupted by a reset. Nothing else is
+    // written to the head sector until the compaction is done, so everything
+    // after its sector header is a copy
+    uint16_t next_sector = (head_sector + 1) % flash->sector_count;
+    if (!is_sector_erased(next_sector)) {
+        compact_sector(next_sector, head_slot - 1);
+    }
+
+    return 0;
+}
+
+void message_journal_replay( message_journal_replay_callback_t callback ) {
+    struct journal_record record;
+
+    if (journal_flash == NULL) {
+        return;
+    }
+
+    // Oldest sector first, the one after the head is always erased
+    for (uint16_t i = 2; i <= journal_flash->sector_count; i++) {
+        uint16_t sector = (head_sector + i) % journal_flash->sector_count;
+
+        read_record(sector * SLOTS_PER_SECTOR, &record);
+        if (record.state != RECORD_SECTOR_HEADER) {
+            continue;
+        }
+
+        for (uint16_t j = 1; j < SLOTS_PER_SECTOR; j++) {
+            uint16_t slot = sector * SLOTS_PER_SECTOR + j;
+
+            read_record(slot, &record);
+            if (record.state == RECORD_ERASED) {
+                break;
+            }
+
+            if (record.state == RECORD_LIVE && record.check == record_check(&record)) {
+                callback(slot, record.f_port, record.priority, record.header, &record.content[0]);
+            }
+        }
+    }
+}
+
+uint16_t message_journal_append( uint8_t f_port, uint8_t priority, uint32_t header, const uint8_t* content, uint8_t content_length ) {
+    if (journal_flash == NULL) {
+        return MESSAGE_JOURNAL_NO_SLOT;
+    }
+
+    if (content_length > 7) {
+        content_length = 7;
+    }
+
+    if (head_slot >= SLOTS_PER_SECTOR) {
+        start_next_sector();
+
+        // Every record of the compacted sector was live and took the fresh
+        // sector's last slot, the message is only kept in RAM
+        if (head_slot >= SLOTS_PER_SECTOR) {
+            return MESSAGE_JOURNAL_NO_SLOT;
+        }
+    }
+
+    return append_record(f_port, priority, header, content, content_length);
+}
+
+void message_journal_remove( uint16_t slot ) {
+    if (journal_flash == NULL || slot == MESSAGE_JOURNAL_NO_SLOT) {
+        return;
+    }
+
+    // Records in the page that's still buffered are tombstoned in place
+    if ((slot / SLOTS_PER_SECTOR) == head_sector &&
+        ((slot % SLOTS_PER_SECTOR) / RECORDS_PER_PAGE) == (head_slot / RECORDS_PER_PAGE)) {
+        page_buffer[(slot % RECORDS_PER_PAGE) * MESSAGE_JOURNAL_RECORD_SIZE] = RECORD_TOMBSTONE;
+        page_dirty = true;
+        return;
+    }
+
+    if (pending_tombstone_count == MAX_PENDING_TOMBSTONES) {
+        flush_tombstones();
+    }
+    pending_tombstones[pending_tombstone_count++] = slot;
+}
+
+bool message_journal_is_dirty() {
+    return page_dirty || pending_tombstone_count;
+}
+
+void message_journal_flush() {
+    if (journal_flash == NULL) {
+        return;
+    }
+
+    flush_page();
+    flush_tombstones();
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Append-only, log-structured journal that keeps guaranteed delivery messages
+ * in flash so that they survive a reset.
+ */
+
+#ifndef _MESSAGE_JOURNAL_H_
+#define _MESSAGE_JOURNAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MESSAGE_JOURNAL_SECTOR_SIZE 4096
+#define MESSAGE_JOURNAL_PAGE_SIZE 256
+#define MESSAGE_JOURNAL_RECORD_SIZE 16
+#define MESSAGE_JOURNAL_NO_SLOT 0xFFFF
+
+// Flash access used by the journal. Offsets are relative to the start of the
+// journal region, which is sector_count * MESSAGE_JOURNAL_SECTOR_SIZE bytes long.
+// program is always called with whole, page aligned pages and erase with whole,
+// sector aligned sectors. Swap in a RAM backed implementation to run the journal
+// on the host.
+struct message_journal_flash {
+    uint16_t sector_count; // must be >= 3
+    void (*read)(uint32_t offset, uint8_t* data, uint32_t length);
+    void (*program)(uint32_t offset, const uint8_t* data, uint32_t length);
+    void (*erase)(uint32_t offset, uint32_t length);
+};
+
+// Called for every live record during message_journal_replay()
+typedef void (*message_journal_replay_callback_t)(uint16_t slot, uint8_t f_port, uint8_t priority, uint32_t header, const uint8_t* content);
+
+// Called when compaction moves a live record to a new slot
+typedef void (*message_journal_relocate_callback_t)(uint16_t old_slot, uint16_t new_slot);
+
+int message_journal_init(const struct message_journal_flash* flash, message_journal_relocate_callback_t on_relocate);
+
+void message_journal_replay(message_journal_replay_callback_t callback);
+
+uint16_t message_journal_append(uint8_t f_port, uint8_t priority, uint32_t header, const uint8_t* content, uint8_t content_length);
+
+void message_journal_remove(uint16_t slot);
+
+bool message_journal_is_dirty();
+
+void message_journal_flush();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
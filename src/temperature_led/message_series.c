@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Series layout
+ *
+ *   byte 0       - column count (bits 7-5) and message count - 1 (bits 4-0)
+ *   bytes 1..n   - content of the first message, one byte per column
+ *   bit stream   - one entry per following message, MSB first
+ *
+ * The first timestamp is the one in the record header. Each following timestamp
+ * is stored as the change in the gap between messages (delta-of-delta), so
+ * messages that were queued at a steady rate cost a single bit:
+ *
+ *   0                      - same gap as before
+ *   10  + 7 bit zig-zag    - gap changed by -64..63 seconds
+ *   110 + 12 bit zig-zag   - gap changed by -2048..2047 seconds
+ *   111 + 21 bit zig-zag   - anything else within a week
+ *
+ * Each content byte is a column, stored as the zig-zag encoded change from the
+ * previous message (modulo 256, so multi-byte values round trip exactly):
+ *
+ *   0                      - unchanged
+ *   10  + 3 bit zig-zag    - changed by -4..3
+ *   11  + 8 bit zig-zag    - anything else
+ *
+ * The stream is zero padded to a multiple of 4 bytes. The count in byte 0 tells
+ * the decoder where the messages end.
+ */
+
+#include <string.h>
+
+#include "message_series.h"
+
+#define SECONDS_PER_DAY 86400
+#define SECONDS_PER_WEEK (7 * SECONDS_PER_DAY)
+
+// Message timestamps are DOW in bits 17-19 and seconds past midnight in bits 0-16
+static uint32_t timestamp_to_seconds( uint32_t timestamp ) {
+    return ((timestamp >> 17) & 0x07) * SECONDS_PER_DAY + (timestamp & 0x1FFFF);
+}
+
+static uint32_t seconds_to_timestamp( uint32_t seconds ) {
+    return ((seconds / SECONDS_PER_DAY) << 17) | (seconds % SECONDS_PER_DAY);
+}
+
+static uint32_t zig_zag( int32_t value ) {
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static int32_t un_zig_zag( uint32_t value ) {
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+// Signed gap between two timestamps, wrapped into half a week either way
+static int32_t time_delta( uint32_t from, uint32_t to ) {
+    int32_t delta = (int32_t) to - (int32_t) from;
+
+    if (delta > SECONDS_PER_WEEK / 2) {
+        delta -= SECONDS_PER_WEEK;
+    } else if (delta <= -SECONDS_PER_WEEK / 2) {
+        delta += SECONDS_PER_WEEK;
+    }
+
+    return delta;
+}
+
+static void write_bits( struct message_series_encoder* encoder, uint32_t value, uint8_t bits ) {
+    while (bits--) {
+        if ((value >> bits) & 1) {
+            encoder->buffer[encoder->bit_length / 8] |= 0x80 >> (encoder->bit_length % 8);
+        }
+        encoder->bit_length++;
+    }
+}
+
+static uint32_t read_bits( struct message_series_decoder* decoder, uint8_t bits ) {
+    uint32_t value = 0;
+
+    // Reads past the end return zeros, the caller checks bit_position afterwards
+    while (bits--) {
+        value <<= 1;
+        if (decoder->bit_position < decoder->length * 8) {
+            value |= (decoder->buffer[decoder->bit_position / 8] >> (7 - (decoder->bit_position % 8))) & 1;
+        }
+        decoder->bit_position++;
+    }
+
+    return value;
+}
+
+static uint8_t time_bits( int32_t delta_of_delta ) {
+    uint32_t value = zig_zag(delta_of_delta);
+
+    return value == 0 ? 1 : value < (1 << 7) ? 2 + 7 : value < (1 << 12) ? 3 + 12 : 3 + 21;
+}
+
+static uint8_t column_bits( uint8_t value ) {
+    return value == 0 ? 1 : value < (1 << 3) ? 2 + 3 : 2 + 8;
+}
+
+static uint8_t column_zig_zag( uint8_t from, uint8_t to ) {
+    int8_t delta = (int8_t) (uint8_t) (to - from);
+
+    return (uint8_t) zig_zag(delta);
+}
+
+bool message_series_encoder_init(struct message_series_encoder* encoder, uint8_t* buffer, uint8_t capacity, uint32_t timestamp, const uint8_t* content, uint8_t content_length) {
+    if (capacity > MESSAGE_SERIES_MAX_LENGTH) {
+        capacity = MESSAGE_SERIES_MAX_LENGTH;
+    }
+    capacity &= ~0x03;
+
+    if (content_length == 0 || content_length > MESSAGE_SERIES_MAX_COLUMNS || 1 + content_length > capacity) {
+        return false;
+    }
+
+    memset(buffer, 0, capacity);
+    buffer[0] = content_length << 5;
+    memcpy(&buffer[1], content, content_length);
+
+    encoder->buffer = buffer;
+    encoder->capacity = capacity;
+    encoder->bit_length = (1 + content_length) * 8;
+    encoder->columns = content_length;
+    encoder->count = 1;
+    encoder->last_time = timestamp_to_seconds(timestamp);
+    encoder->last_delta = 0;
+    memcpy(&encoder->last_values[0], content, content_length);
+
+    return true;
+}
+
+bool message_series_encoder_append(struct message_series_encoder* encoder, uint32_t timestamp, const uint8_t* content) {
+    if (encoder->count >= MESSAGE_SERIES_MAX_COUNT) {
+        return false;
+    }
+
+    uint32_t time = timestamp_to_seconds(timestamp);
+    int32_t delta = time_delta(encoder->last_time, time);
+    int32_t delta_of_delta = delta - encoder->last_delta;
+
+    // Size the entry first so that nothing is written unless all of it fits
+    uint16_t bits = time_bits(delta_of_delta);
+    for (int i = 0; i < encoder->columns; i++) {
+        bits += column_bits(column_zig_zag(encoder->last_values[i], content[i]));
+    }
+    if (encoder->bit_length + bits > encoder->capacity * 8) {
+        return false;
+    }
+
+    uint32_t value = zig_zag(delta_of_delta);
+    if (value == 0) {
+        write_bits(encoder, 0, 1);
+    } else if (value < (1 << 7)) {
+        write_bits(encoder, 0x02, 2);
+        write_bits(encoder, value, 7);
+    } else if (value < (1 << 12)) {
+        write_bits(encoder, 0x06, 3);
+        write_bits(encoder, value, 12);
+    } else {
+        write_bits(encoder, 0x07, 3);
+        write_bits(encoder, value, 21);
+    }
+
+    for (int i = 0; i < encoder->columns; i++) {
+        uint8_t column = column_zig_zag(encoder->last_values[i], content[i]);
+
+        if (column == 0) {
+            write_bits(encoder, 0, 1);
+        } else if (column < (1 << 3)) {
+            write_bits(encoder, 0x02, 2);
+            write_bits(encoder, column, 3);
+        } else {
+            write_bits(encoder, 0x03, 2);
+            write_bits(encoder, column, 8);
+        }
+        encoder->last_values[i] = content[i];
+    }
+
+    encoder->last_time = time;
+    encoder->last_delta = delta;
+    encoder->count++;
+    encoder->buffer[0] = (encoder->columns << 5) | (encoder->count - 1);
+
+    return true;
+}
+
+uint8_t message_series_encoder_length(const struct message_series_encoder* encoder) {
+    return (((encoder->bit_length + 7) / 8) + 3) & ~0x03;
+}
+
+bool message_series_decoder_init(struct message_series_decoder* decoder, const uint8_t* buffer, uint8_t length, uint32_t timestamp) {
+    if (length < 1) {
+        return false;
+    }
+
+    uint8_t columns = buffer[0] >> 5;
+    if (columns == 0 || 1 + columns > length) {
+        return false;
+    }
+
+    decoder->buffer = buffer;
+    decoder->length = length;
+    decoder->bit_position = (1 + columns) * 8;
+    decoder->columns = columns;
+    decoder->count = (buffer[0] & 0x1F) + 1;
+    decoder->index = 0;
+    decoder->last_time = timestamp_to_seconds(timestamp);
+    decoder->last_delta = 0;
+    memcpy(&decoder->last_values[0], &buffer[1], columns);
+
+    return true;
+}
+
+bool message_series_decoder_next(struct message_series_decoder* decoder, uint32_t* timestamp, uint8_t* content, uint8_t* content_length) {
+    if (decoder->index >= decoder->count) {
+        return false;
+    }
+
+    if (decoder->index > 0) {
+        uint32_t value = 0;
+        if (read_bits(decoder, 1) == 0) {
+            value = 0;
+        } else if (read_bits(decoder, 1) == 0) {
+            value = read_bits(decoder, 7);
+        } else if (read_bits(decoder, 1) == 0) {
+            value = read_bits(decoder, 12);
+        } else {
+            value = read_bits(decoder, 21);
+        }
+        decoder->last_delta += un_zig_zag(value);
+        decoder->last_time = (decoder->last_time + SECONDS_PER_WEEK + decoder->last_delta) % SECONDS_PER_WEEK;
+
+        for (int i = 0; i < decoder->columns; i++) {
+            uint8_t column = 0;
+            if (read_bits(decoder, 1) == 0) {
+                column = 0;
+            } else if (read_bits(decoder, 1) == 0) {
+                column = read_bits(decoder, 3);
+            } else {
+                column = read_bits(decoder, 8);
+            }
+            decoder->last_values[i] += (uint8_t) un_zig_zag(column);
+        }
+
+        // Truncated series
+        if (decoder->bit_position > decoder->length * 8) {
+            decoder->index = decoder->count;
+            return false;
+        }
+    }
+
+    *timestamp = seconds_to_timestamp(decoder->last_time);
+    memcpy(content, &decoder->last_values[0], decoder->columns);
+    *content_length = decoder->columns;
+    decoder->index++;
+
+    return true;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Compact encoding for a run of same-type messages, sent as a single version 1
+ * record instead of one header plus content per message.
+ */
+
+#ifndef _MESSAGE_SERIES_H_
+#define _MESSAGE_SERIES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MESSAGE_SERIES_MAX_LENGTH 60 // bytes, the header counts in 4 byte words
+#define MESSAGE_SERIES_MAX_COUNT 32
+#define MESSAGE_SERIES_MAX_COLUMNS 7
+
+struct message_series_encoder {
+    uint8_t* buffer;
+    uint8_t capacity;
+    uint16_t bit_length;
+    uint8_t columns;
+    uint8_t count;
+    uint32_t last_time;
+    int32_t last_delta;
+    uint8_t last_values[MESSAGE_SERIES_MAX_COLUMNS];
+};
+
+struct message_series_decoder {
+    const uint8_t* buffer;
+    uint8_t length;
+    uint16_t bit_position;
+    uint8_t columns;
+    uint8_t count;
+    uint8_t index;
+    uint32_t last_time;
+    int32_t last_delta;
+    uint8_t last_values[MESSAGE_SERIES_MAX_COLUMNS];
+};
+
+// Starts a series with its first message. timestamp is in the message header
+// format (DOW and seconds past midnight) and is not written to the buffer since
+// it goes out in the record header. Returns false if the first message doesn't fit
+bool message_series_encoder_init(struct message_series_encoder* encoder, uint8_t* buffer, uint8_t capacity, uint32_t timestamp, const uint8_t* content, uint8_t content_length);
+
+// Returns false, leaving the encoder untouched, if the message doesn't fit
+bool message_series_encoder_append(struct message_series_encoder* encoder, uint32_t timestamp, const uint8_t* content);
+
+// Encoded length in bytes, zero padded to a multiple of 4
+uint8_t message_series_encoder_length(const struct message_series_encoder* encoder);
+
+bool message_series_decoder_init(struct message_series_decoder* decoder, const uint8_t* buffer, uint8_t length, uint32_t timestamp);
+
+// Returns false once every message has been decoded, content must have room for
+// MESSAGE_SERIES_MAX_COLUMNS bytes
+bool message_series_decoder_next(struct message_series_decoder* decoder, uint32_t* timestamp, uint8_t* content, uint8_t* content_length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Each core has its own ring, so the only contention is with interrupt handlers
+ * on the same core, which trace() keeps out by disabling interrupts for the few
+ * stores it takes to fill a record. trace_drain() is the only consumer. As with
+ * the sensor ring in main.c the producer only writes head and the consumer only
+ * writes tail, with memory barriers ordering the record against its index.
+ *
+ * Records are written out as text lines that can be mixed in with printf output:
+ *
+ *   #T<core:1><time_us:8><event:4><arg0:4><arg1:8><arg2:8>
+ *
+ * with every field in hex. decode_trace.py turns them back into messages.
+ */
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+
+#include "trace.h"
+
+#define TRACE_CORE_COUNT 2
+
+struct trace_record {
+    uint32_t time_us;
+    uint16_t event;
+    uint16_t arg0;
+    uint32_t arg1;
+    uint32_t arg2;
+};
+
+struct trace_ring {
+    struct trace_record records[TRACE_RING_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t dropped; // written by the producer only
+    uint32_t reported_dropped; // written by the consumer only
+};
+
+static struct trace_ring trace_rings[TRACE_CORE_COUNT];
+
+void trace(uint16_t event, uint16_t arg0, uint32_t arg1, uint32_t arg2) {
+    struct trace_ring* ring = &trace_rings[get_core_num()];
+    uint32_t interrupts = save_and_disable_interrupts();
+    uint32_t head = ring->head;
+
+    if (head - ring->tail >= TRACE_RING_SIZE) {
+        ring->dropped++;
+    } else {
+        struct trace_record* record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+
+        record->time_us = time_us_32();
+        record->event = event;
+        record->arg0 = arg0;
+        record->arg1 = arg1;
+        record->arg2 = arg2;
+        __dmb();
+        ring->head = head + 1;
+    }
+
+    restore_interrupts(interrupts);
+}
+
+static char* put_hex(char* line, uint32_t value, int digits) {
+    static const char hex_digits[] = "0123456789abcdef";
+
+    for (int i = digits - 1; i >= 0; i--) {
+        line[i] = hex_digits[value & 0x0F];
+        value >>= 4;
+    }
+
+    return line + digits;
+}
+
+static void write_record(uint core, const struct trace_record* record) {
+    char line[2 + 1 + 8 + 4 + 4 + 8 + 8 + 1];
+    char* position = &line[0];
+
+    *position++ = '#';
+    *position++ = 'T';
+    position = put_hex(position, core, 1);
+    position = put_hex(position, record->time_us, 8);
+    position = put_hex(position, record->event, 4);
+    position = put_hex(position, record->arg0, 4);
+    position = put_hex(position, record->arg1, 8);
+    position = put_hex(position, record->arg2, 8);
+    *position++ = '\n';
+
+    fwrite(line, 1, position - &line[0], stdout);
+}
+
+void trace_drain(void) {
+    struct trace_record record;
+
+    for (uint core = 0; core < TRACE_CORE_COUNT; core++) {
+        struct trace_ring* ring = &trace_rings[core];
+
+        while (ring->tail != ring->head) {
+            uint32_t tail = ring->tail;
+
+            __dmb();
+            record = ring->records[tail & (TRACE_RING_SIZE - 1)];
+            __dmb();
+            ring->tail = tail + 1;
+
+            write_record(core, &record);
+        }
+
+        uint32_t dropped = ring->dropped;
+        if (dropped != ring->reported_dropped) {
+            record.time_us = time_us_32();
+            record.event = TRACE_DROPPED;
+            record.arg0 = dropped - ring->reported_dropped;
+            record.arg1 = 0;
+            record.arg2 = 0;
+            write_record(core, &record);
+            ring->reported_dropped = dropped;
+        }
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Deferred binary trace. trace() only stores an event id, a timestamp and three
+ * arguments in a per-core RAM ring; the text is put together later, on the host,
+ * by decode_trace.py.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_RING_SIZE 64 // per core, must be a power of two
+
+enum trace_event {
+#define TRACE_EVENT(id, format) id,
+#include "trace_events.h"
+#undef TRACE_EVENT
+    TRACE_EVENT_COUNT
+};
+
+// Safe to call from either core and from interrupt handlers, never blocks. A full
+// ring drops the record and counts it
+void trace(uint16_t event, uint16_t arg0, uint32_t arg1, uint32_t arg2);
+
+// Writes out every buffered record, one "#T" line each. Call from one place only,
+// when there's nothing better to do
+void trace_drain(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
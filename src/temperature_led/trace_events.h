@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Trace events, included with TRACE_EVENT(id, format) defined by the includer.
+ *
+ * format is only used by decode_trace.py, which reads it straight out of this
+ * file. It's printf style and consumes the record's arg0 (16 bits), arg1 and arg2
+ * (32 bits each) in that order. Events are numbered in list order, so only ever
+ * append to the list or older captures will decode wrongly.
+ */
+
+TRACE_EVENT(TRACE_DROPPED, "trace ring overflowed, %u records dropped")
+TRACE_EVENT(TRACE_FREE_ENTRIES, "free message entries available: %u")
+TRACE_EVENT(TRACE_CREATE_MESSAGE, "creating new message on port %u with length = %u")
+TRACE_EVENT(TRACE_MESSAGE_DUE, "message due check: %u sends, last at %u s, age %u s")
+TRACE_EVENT(TRACE_PACK_MESSAGE, "packing message on port %u, header = 0x%08x, content = 0x%08x")
+TRACE_EVENT(TRACE_PACK_SERIES, "packing %u messages of type %u as a %u byte series")
+TRACE_EVENT(TRACE_SEND, "sending %u messages, %u bytes on port %u")
+TRACE_EVENT(TRACE_SEND_RESULT, "send result = %d")
+TRACE_EVENT(TRACE_RECEIVE, "received a %u byte message on port %u: 0x%08x...")
+TRACE_EVENT(TRACE_ACK, "ack on port %u, header = 0x%08x")
+TRACE_EVENT(TRACE_TEMPERATURE_SUMMARY, "temperature summary: mean %d, min %d, max %d (tenths of C)")
+TRACE_EVENT(TRACE_TEMPERATURE_UNCHANGED, "temperature window unchanged: mean %d (tenths of C) over %u samples, not reported")
+TRACE_EVENT(TRACE_DOOR_EVENT, "gpio: %u, content: %u")
+TRACE_EVENT(TRACE_ACK_RTT, "ack round trip %u s, smoothed %u s, retry timeout %u s")
+TRACE_EVENT(TRACE_MESSAGE_EXPIRED, "message on port %u expired unsent, header = 0x%08x, age %u s")
+TRACE_EVENT(TRACE_AIR_TIME, "uplink time on air %u ms, duty cycle wait %u ms")
+TRACE_EVENT(TRACE_RECEIVE_INFO, "downlink rssi %d dBm, snr %d dB, downlink counter %u")
+TRACE_EVENT(TRACE_UPLINK_DONE, "uplink done: result %d, datarate %u, uplink counter %u")
+TRACE_EVENT(TRACE_UPLINK_ACK, "confirmed uplink sent %u times, acked %u, releases %u messages")
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Compression ratio of the series codec on a few message streams. Each stream is
+ * cut into series as long as the codec takes, and the bytes of a version 1 record
+ * per series (4 byte header plus the encoded series) are compared with a plain
+ * record (4 byte header plus content) per message.
+ */
+
+#include <string.h>
+
+#include "message_series.h"
+
+#include "host.h"
+
+#define SECONDS_PER_DAY 86400
+#define STREAM_LENGTH 2000
+
+struct stream_message {
+    uint32_t timestamp;
+    uint8_t content[MESSAGE_SERIES_MAX_COLUMNS];
+};
+
+static struct stream_message stream[STREAM_LENGTH];
+static uint32_t random_state = 42;
+
+static uint32_t random_next( void ) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return random_state;
+}
+
+static int random_between( int low, int high ) {
+    return low + (int) (random_next() % (uint32_t) (high - low + 1));
+}
+
+static uint32_t to_timestamp( uint32_t seconds ) {
+    seconds %= 7 * SECONDS_PER_DAY;
+
+    return ((seconds / SECONDS_PER_DAY) << 17) | (seconds % SECONDS_PER_DAY);
+}
+
+static void put_int16( uint8_t* content, int16_t value ) {
+    content[0] = (uint16_t) value >> 8;
+    content[1] = value;
+}
+
+// Temperature window summaries (mean, min, max, standard deviation) every three
+// minutes, give or take jitter seconds, with a slow drift
+static void temperature_summaries( int jitter ) {
+    int mean = 215;
+
+    for (int i = 0; i < STREAM_LENGTH; i++) {
+        mean += random_between(-2, 2);
+        stream[i].timestamp = to_timestamp(i * 180 + (jitter ? random_between(-jitter, jitter) : 0));
+        put_int16(&stream[i].content[0], mean);
+        put_int16(&stream[i].content[2], mean - random_between(0, 6));
+        put_int16(&stream[i].content[4], mean + random_between(0, 6));
+        stream[i].content[6] = random_between(0, 4);
+    }
+}
+
+// A 3 byte counter read once a minute
+static void counter_readings( int columns ) {
+    uint32_t counter = 100000;
+
+    for (int i = 0; i < STREAM_LENGTH; i++) {
+        counter += random_between(0, 5);
+        stream[i].timestamp = to_timestamp(i * 60);
+        for (int j = 0; j < columns; j++) {
+            stream[i].content[j] = counter >> (8 * (columns - 1 - j));
+        }
+    }
+}
+
+// Random gaps and content, the worst case
+static void noise( int columns ) {
+    uint32_t seconds = 0;
+
+    for (int i = 0; i < STREAM_LENGTH; i++) {
+        seconds += random_between(1, 5000);
+        stream[i].timestamp = to_timestamp(seconds);
+        for (int j = 0; j < columns; j++) {
+            stream[i].content[j] = random_next();
+        }
+    }
+}
+
+static double run( const char* name, int columns ) {
+    uint8_t buffer[MESSAGE_SERIES_MAX_LENGTH];
+    struct message_series_encoder encoder;
+    uint32_t series_bytes = 0;
+    uint32_t series_count = 0;
+    int position = 0;
+
+    uint64_t start = host_wall_clock_ns();
+    while (position < STREAM_LENGTH) {
+        CHECK(message_series_encoder_init(&encoder, buffer, sizeof(buffer), stream[position].timestamp, stream[position].content, columns));
+        position++;
+        while (position < STREAM_LENGTH && message_series_encoder_append(&encoder, stream[position].timestamp, stream[position].content)) {
+            position++;
+        }
+
+        series_bytes += sizeof(uint32_t) + message_series_encoder_length(&encoder);
+        series_count++;
+    }
+    double encode_ns = (double) (host_wall_clock_ns() - start) / STREAM_LENGTH;
+
+    uint32_t plain_bytes = STREAM_LENGTH * (sizeof(uint32_t) + columns);
+    double ratio = (double) plain_bytes / series_bytes;
+
+    printf("%-28s plain %6u bytes, series %6u bytes, %.2fx, %5.1f messages per series, %5.1f ns per message\n",
+        name, plain_bytes, series_bytes, ratio, (double) STREAM_LENGTH / series_count, encode_ns);
+
+    return ratio;
+}
+
+int main( void ) {
+    temperature_summaries(0);
+    CHECK(run("temperature summaries", 7) > 2);
+
+    temperature_summaries(2);
+    CHECK(run("temperature summaries, +/-2s", 7) > 1.5);
+
+    counter_readings(3);
+    CHECK(run("counter readings", 3) > 3);
+
+    noise(3);
+    // Little to gain, and pack_series() falls back to plain records for any
+    // series that doesn't pay off
+    run("random", 3);
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Message slab and ack index against the singly linked free list and message
+ * list that they replaced. The queue is filled to MESSAGE_QUEUE_SIZE - 1 and then
+ * churned: every operation acks a random queued message, i.e. looks it up by its
+ * header and removes it, and queues a new one in its place. Built once per queue
+ * size, see CMakeLists.txt.
+ */
+
+#define main temperature_led_main
+#include "../src/temperature_led/main.c"
+#undef main
+
+#include "host.h"
+
+#define CHURN_OPERATIONS 10000
+#define BENCH_PORT 1
+#define BENCH_TYPE 4
+
+static uint32_t random_state = 12345;
+
+static uint32_t random_next( void ) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return random_state;
+}
+
+static uint32_t bench_timestamp( uint32_t seconds ) {
+    seconds %= 7 * SECONDS_PER_DAY;
+
+    return ((seconds / SECONDS_PER_DAY) << 17) | (seconds % SECONDS_PER_DAY);
+}
+
+//
+// The linked list implementation from before the slab, less its debug output
+//
+struct list_entry {
+    uint32_t header;
+    uint8_t content[7];
+    uint8_t version;
+    uint8_t f_port;
+    bool guaranteed_delivery;
+    uint8_t type;
+    uint8_t content_length;
+    uint64_t send_time;
+    uint8_t dow;
+    uint16_t index;
+    struct list_entry* next;
+};
+static struct list_entry* list_queue = NULL;
+static struct list_entry* list_free_queue = NULL;
+
+static void list_init( void ) {
+    for (int i = 0; i < MESSAGE_QUEUE_SIZE; i++) {
+        struct list_entry* message = (struct list_entry*) malloc(sizeof(struct list_entry));
+        message->index = i;
+        message->next = list_free_queue;
+        list_free_queue = message;
+    }
+}
+
+static void list_cleanup_message( struct list_entry* message ) {
+    if (message == list_queue) {
+        list_queue = message->next;
+    } else {
+        struct list_entry* previous = list_queue;
+        struct list_entry* current = list_queue->next;
+        while (current != NULL) {
+            if (current == message) {
+                previous->next = current->next;
+                break;
+            }
+
+            previous = current;
+            current = current->next;
+        }
+    }
+
+    message->next = list_free_queue;
+    list_free_queue = message;
+}
+
+static void list_create_message_entry( uint32_t timestamp, uint8_t f_port, bool guaranteed_delivery, uint8_t type, uint8_t* content, uint8_t content_length ) {
+    struct list_entry* message = list_free_queue;
+    CHECK(message != NULL);
+    list_free_queue = list_free_queue->next;
+
+    message->header =
+        ((MESSAGE_VERSION & 0x07) << 29) |
+        ((timestamp & 0xFFFFF) << 9) |
+        (guaranteed_delivery ? 1 : 0) << 8 |
+        ((type & 0x0F) << 4) |
+        (content_length & 0x0F);
+    message->version = MESSAGE_VERSION;
+    message->f_port = f_port;
+    message->guaranteed_delivery = guaranteed_delivery;
+    message->type = type;
+    message->content_length = content_length;
+    message->send_time = 0;
+    message->dow = (timestamp >> 17) & 0x07;
+    memcpy(&message->content[0], content, content_length);
+
+    message->next = list_queue;
+    list_queue = message;
+}
+
+static struct list_entry* list_match_message_by_header( uint8_t receive_port, bool guaranteed_delivery, uint8_t type, uint32_t response_timestamp ) {
+    struct list_entry* current = list_queue;
+
+    while (current != NULL) {
+        if ((receive_port == current->f_port) &&
+            (response_timestamp == ((current->header >> 9) & 0xFFFFF)) &&
+            (guaranteed_delivery == current->guaranteed_delivery) &&
+            (type == current->type)) {
+            break;
+        }
+
+        current = current->next;
+    }
+
+    return current;
+}
+
+//
+// Workload
+//
+static uint32_t live_seconds[MESSAGE_QUEUE_SIZE];
+
+static double run_slab( int queued ) {
+    uint8_t content[3] = { 1, 2, 3 };
+    uint32_t next_second = 0;
+
+    init_message_queue();
+    for (int i = 0; i < queued; i++) {
+        live_seconds[i] = next_second++;
+        create_message_entry_at(bench_timestamp(live_seconds[i]), BENCH_PORT, MESSAGE_PRIORITY_TELEMETRY, false, BENCH_TYPE, content, sizeof(content));
+    }
+    CHECK(queued_message_count() == (uint32_t) queued);
+
+    uint64_t start = host_wall_clock_ns();
+    for (int i = 0; i < CHURN_OPERATIONS; i++) {
+        int victim = random_next() % queued;
+        struct message_entry* message = match_message_by_header(MESSAGE_VERSION, BENCH_PORT, false, BENCH_TYPE, bench_timestamp(live_seconds[victim]));
+
+        CHECK(message != NULL);
+        cleanup_message(message);
+
+        live_seconds[victim] = next_second++;
+        create_message_entry_at(bench_timestamp(live_seconds[victim]), BENCH_PORT, MESSAGE_PRIORITY_TELEMETRY, false, BENCH_TYPE, content, sizeof(content));
+    }
+    uint64_t elapsed = host_wall_clock_ns() - start;
+
+    CHECK(queued_message_count() == (uint32_t) queued);
+    CHECK(get_free_entry_count() == MESSAGE_QUEUE_SIZE - queued);
+
+    return (double) elapsed / CHURN_OPERATIONS;
+}
+
+static double run_list( int queued ) {
+    uint8_t content[3] = { 1, 2, 3 };
+    uint32_t next_second = 0;
+
+    list_init();
+    for (int i = 0; i < queued; i++) {
+        live_seconds[i] = next_second++;
+        list_create_message_entry(bench_timestamp(live_seconds[i]), BENCH_PORT, false, BENCH_TYPE, content, sizeof(content));
+    }
+
+    uint64_t start = host_wall_clock_ns();
+    for (int i = 0; i < CHURN_OPERATIONS; i++) {
+        int victim = random_next() % queued;
+        struct list_entry* message = list_match_message_by_header(BENCH_PORT, false, BENCH_TYPE, bench_timestamp(live_seconds[victim]));
+
+        CHECK(message != NULL);
+        list_cleanup_message(message);
+
+        live_seconds[victim] = next_second++;
+        list_create_message_entry(bench_timestamp(live_seconds[victim]), BENCH_PORT, false, BENCH_TYPE, content, sizeof(content));
+    }
+
+    return (double) (host_wall_clock_ns() - start) / CHURN_OPERATIONS;
+}
+
+int main( void ) {
+    int queued = MESSAGE_QUEUE_SIZE - 1;
+
+    double slab_ns = run_slab(queued);
+    double list_ns = run_list(queued);
+
+    printf("queue size %6d: slab %8.1f ns/ack+insert, list %10.1f ns/ack+insert (%.1fx)\n",
+        MESSAGE_QUEUE_SIZE, slab_ns, list_ns, list_ns / slab_ns);
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Retransmission under gateway loss. A door message (guaranteed delivery) is
+ * queued every one to ten minutes for two simulated days and the main loop runs
+ * against the simulated network, which loses uplinks and the ack downlinks with
+ * the same probability. For each loss rate it reports how many messages reached
+ * the server, the percentiles of the time from queuing to first receipt, and
+ * the airtime cost in uplinks and duplicate receipts per message.
+ */
+
+#include <math.h>
+
+#define main temperature_led_main
+#include "../src/temperature_led/main.c"
+#undef main
+
+#include "host.h"
+
+#define SIMULATED_US (48 * 3600 * 1000000ULL)
+#define DRAIN_US (12 * 3600 * 1000000ULL) // no new messages, let the retries run out
+#define MAX_GENERATED 1024
+#define DOOR_PORT 1
+#define DOOR_TYPE 2
+
+struct generated_message {
+    uint32_t timestamp;
+    uint64_t created_us;
+    uint64_t delivered_us;
+    uint32_t receipts;
+};
+static struct generated_message generated[MAX_GENERATED];
+static int generated_count = 0;
+
+static uint32_t random_state = 1;
+
+static uint32_t random_next( void ) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return random_state;
+}
+
+static void on_record( uint8_t f_port, uint32_t header, const uint8_t* content, uint8_t content_length ) {
+    uint32_t timestamp = (header >> 9) & 0xFFFFF;
+
+    if (f_port != DOOR_PORT || ((header >> 4) & 0x0F) != DOOR_TYPE) {
+        return;
+    }
+
+    for (int i = 0; i < generated_count; i++) {
+        if (generated[i].timestamp == timestamp) {
+            if (generated[i].receipts++ == 0) {
+                generated[i].delivered_us = host_time_us;
+            }
+            return;
+        }
+    }
+
+    CHECK(0);
+}
+
+static int compare_double( const void* a, const void* b ) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile( const double* sorted, int count, double p ) {
+    int index = (int) ceil(p * count) - 1;
+
+    return sorted[index < 0 ? 0 : index];
+}
+
+// One simulated run of the main loop, see service_messages()
+static void simulate( double loss ) {
+    static double latencies[MAX_GENERATED];
+    uint64_t next_message_time = 0;
+    uint8_t door_open = 0;
+    uint32_t iterations = 0;
+
+    // Fresh state, as after a reset
+    init_message_queue();
+    host_time_us = 0;
+    host_network_reset(12345);
+    random_state = 1; // the same messages at every loss rate
+    host_network.uplink_loss = loss;
+    host_network.downlink_loss = loss;
+    host_network.on_record = on_record;
+    generated_count = 0;
+    transfer_state = TRANSFER_IDLE;
+    ack_rtt_sampled = false;
+    retry_timeout_s = MESSAGE_TIMEOUT_US / 1000000;
+    retry_tokens = RETRY_BUDGET;
+    retry_tokens_time = 0;
+    send_retry_time = 0;
+    while (pop_due_task(UINT64_MAX) >= 0);
+
+    join();
+    sync_time(true);
+    schedule_task(TASK_DAILY_TASKS, get_us_since_boot() + DAILY_TASK_TIMEOUT_US);
+    schedule_task(TASK_TIME_RESYNC, get_us_since_boot() + TIME_RESYNC_TIMEOUT_US);
+
+    while (host_time_us < SIMULATED_US + DRAIN_US) {
+        CHECK(++iterations < 10000000);
+
+        if (host_time_us >= next_message_time && host_time_us < SIMULATED_US) {
+            CHECK(generated_count < MAX_GENERATED);
+            door_open = !door_open;
+            create_message_entry(DOOR_PORT, MESSAGE_PRIORITY_ALARM, true, DOOR_TYPE, &door_open, 1);
+            generated[generated_count].timestamp = message_timestamp(message_queue_tails[MESSAGE_PRIORITY_ALARM]);
+            generated[generated_count].created_us = host_time_us;
+            generated[generated_count].receipts = 0;
+            generated_count++;
+            next_message_time = host_time_us + (60 + random_next() % 541) * 1000000ULL;
+        }
+
+        int task;
+        while ((task = pop_due_task(get_us_since_boot())) >= 0) {
+            run_task(task);
+        }
+
+        transfer_data_step();
+
+        uint64_t now = get_us_since_boot();
+        uint64_t due_time = next_task_due_time();
+        if (host_time_us < SIMULATED_US && next_message_time + BOOT_TIME_OFFSET_US < due_time) {
+            due_time = next_message_time + BOOT_TIME_OFFSET_US;
+        }
+        uint32_t timeout_ms = MAX_SLEEP_MS;
+        if (due_time <= now) {
+            timeout_ms = 0;
+        } else if ((due_time - now + 999) / 1000 < MAX_SLEEP_MS) {
+            timeout_ms = (due_time - now + 999) / 1000;
+        }
+        lorawan_process_timeout_ms(timeout_ms);
+    }
+
+    int delivered = 0;
+    uint32_t duplicates = 0;
+    for (int i = 0; i < generated_count; i++) {
+        if (generated[i].receipts > 0) {
+            latencies[delivered++] = (generated[i].delivered_us - generated[i].created_us) / 1e6;
+            duplicates += generated[i].receipts - 1;
+        }
+    }
+    qsort(latencies, delivered, sizeof(latencies[0]), compare_double);
+
+    printf("loss %3.0f%%: delivered %4d/%4d (%5.1f%%), latency p50 %6.0f s p90 %6.0f s p99 %6.0f s max %6.0f s, "
+           "%.2f uplinks and %.2f duplicates per message, %d still queued\n",
+        loss * 100, delivered, generated_count, 100.0 * delivered / generated_count,
+        delivered ? percentile(latencies, delivered, 0.5) : 0,
+        delivered ? percentile(latencies, delivered, 0.9) : 0,
+        delivered ? percentile(latencies, delivered, 0.99) : 0,
+        delivered ? latencies[delivered - 1] : 0,
+        (double) host_network_stats.uplinks / generated_count, (double) duplicates / generated_count, queued_message_count());
+
+    if (loss == 0) {
+        CHECK(delivered == generated_count && duplicates == 0);
+        CHECK(percentile(latencies, delivered, 0.99) < 5);
+    } else if (loss <= 0.3) {
+        CHECK(delivered >= generated_count * 99 / 100);
+    }
+    // Up to moderate loss everything was acked or given up on by the end of the
+    // drain, beyond that the retry budget holds resends back for longer
+    if (loss <= 0.3) {
+        CHECK(queued_message_count() == 0);
+    }
+}
+
+int main( void ) {
+    const double loss_rates[] = { 0, 0.1, 0.3, 0.5, 0.7 };
+
+    for (unsigned i = 0; i < sizeof(loss_rates) / sizeof(loss_rates[0]); i++) {
+        simulate(loss_rates[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Fixed point, oversampled temperature reading against the single float
+ * conversion it replaced:
+ *
+ *   - conversion error over every ADC value, against the datasheet formula in
+ *     double precision
+ *   - error of a reading with ADC noise, for one sample and for the burst
+ *   - host time per conversion. The M0+ has no FPU, so there the float path
+ *     goes through the soft float library and the gap is far wider than on
+ *     the host
+ */
+
+#include <math.h>
+
+#define main temperature_led_main
+#include "../src/temperature_led/main.c"
+#undef main
+
+#include "host.h"
+
+#define NOISE_TRIALS 20000
+#define NOISE_LSB 12 // peak ADC noise, uniform
+#define TIMING_ROUNDS 200
+
+// The conversion from before, in tenths of a degree
+static float float_temperature( uint16_t adc_raw ) {
+    const float v_ref = 3.3;
+
+    float adc_voltage = adc_raw * v_ref / 4095.0f;
+    float adc_temperature = 27.0 - ((adc_voltage - 0.706) / 0.001721);
+
+    return adc_temperature * 10;
+}
+
+static double exact_temperature( double adc_raw ) {
+    return (27.0 - ((adc_raw * 3.3 / 4095.0 - 0.706) / 0.001721)) * 10;
+}
+
+static uint32_t random_state = 7;
+static double noise_center = 0;
+
+static uint32_t random_next( void ) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return random_state;
+}
+
+static uint16_t noisy_sample( void ) {
+    int raw = (int) lround(noise_center) + (int) (random_next() % (2 * NOISE_LSB + 1)) - NOISE_LSB;
+
+    return raw < 0 ? 0 : (raw > 4095 ? 4095 : raw);
+}
+
+int main( void ) {
+    double max_fixed_error = 0;
+    double max_float_error = 0;
+
+    internal_temperature_init();
+
+    // Every ADC value, the burst sees the same value 16 times
+    for (int raw = 0; raw < 4096; raw++) {
+        host_adc_raw = raw;
+
+        double exact = exact_temperature(raw);
+        double fixed_error = fabs(internal_temperature_get() - exact);
+        double float_error = fabs(roundf(float_temperature(raw)) - exact);
+
+        if (fixed_error > max_fixed_error) {
+            max_fixed_error = fixed_error;
+        }
+        if (float_error > max_float_error) {
+            max_float_error = float_error;
+        }
+    }
+    printf("conversion: max error fixed %.3f, float %.3f tenths of a degree\n", max_fixed_error, max_float_error);
+    // Both only lose the rounding to tenths
+    CHECK(max_fixed_error <= 0.5 + 0.01);
+    CHECK(max_float_error <= 0.5 + 1e-3);
+
+    // A sensor that reads around 20 C, with noise
+    double single_squares = 0;
+    double burst_squares = 0;
+    host_adc_sample = noisy_sample;
+    for (int i = 0; i < NOISE_TRIALS; i++) {
+        noise_center = 876 + (i % 100) / 100.0;
+
+        double exact = exact_temperature(noise_center);
+        double single = roundf(float_temperature(noisy_sample())) - exact;
+        double burst = internal_temperature_get() - exact;
+
+        single_squares += single * single;
+        burst_squares += burst * burst;
+    }
+    double single_rms = sqrt(single_squares / NOISE_TRIALS);
+    double burst_rms = sqrt(burst_squares / NOISE_TRIALS);
+    printf("+/-%d LSB noise: rms error single float sample %.2f, %d sample burst %.2f tenths of a degree\n",
+        NOISE_LSB, single_rms, TEMPERATURE_SAMPLE_COUNT, burst_rms);
+    CHECK(burst_rms < single_rms / 2);
+
+    // Conversion only, the sampling is in hardware
+    volatile float float_sink = 0;
+    volatile int16_t fixed_sink = 0;
+    uint64_t start = host_wall_clock_ns();
+    for (int round = 0; round < TIMING_ROUNDS; round++) {
+        for (volatile uint32_t raw = 0; raw < 4096; raw++) {
+            float_sink = float_temperature(raw);
+        }
+    }
+    double float_ns = (double) (host_wall_clock_ns() - start) / (TIMING_ROUNDS * 4096);
+
+    start = host_wall_clock_ns();
+    for (int round = 0; round < TIMING_ROUNDS; round++) {
+        for (volatile uint32_t raw = 0; raw < 4096; raw++) {
+            fixed_sink = internal_temperature_convert(raw * TEMPERATURE_SAMPLE_COUNT);
+        }
+    }
+    double fixed_ns = (double) (host_wall_clock_ns() - start) / (TIMING_ROUNDS * 4096);
+    (void) float_sink;
+    (void) fixed_sink;
+
+    printf("host time per conversion: float %.2f ns, fixed %.2f ns\n", float_ns, fixed_ns);
+
+    return 0;
+}
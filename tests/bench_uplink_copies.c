@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Bytes moved per uplink on the way from the message queue to the radio. Each
+ * workload is queued up front and the main loop sends it all. Every memcpy() in
+ * main.c is counted, split into the bytes that land in the buffer handed out by
+ * lorawan_tx_reserve() and any others, such as a staging buffer would need. The
+ * series encoder writes the rest of the payload in place. The library's copy
+ * into the MAC frame buffer is reported as the simulated library counts it.
+ */
+
+#include <string.h>
+
+#include "host.h"
+
+static uint8_t* tx_buffer = NULL;
+static uint64_t packed_copy_bytes = 0;
+static uint64_t other_copy_bytes = 0;
+
+// Counts what the application copies, into the transmit buffer (see tx_buffer)
+// or anywhere else
+static void* counted_memcpy( void* destination, const void* source, size_t length ) {
+    uint8_t* d = destination;
+
+    if (tx_buffer != NULL && d >= tx_buffer && d < tx_buffer + 242) {
+        packed_copy_bytes += length;
+    } else {
+        other_copy_bytes += length;
+    }
+
+    return memcpy(destination, source, length);
+}
+
+#define main temperature_led_main
+#define memcpy(destination, source, length) counted_memcpy(destination, source, length)
+#include "../src/temperature_led/main.c"
+#undef memcpy
+#undef main
+
+#define SECONDS_PER_DAY 86400
+#define TEMPERATURE_PORT 1
+#define TEMPERATURE_TYPE 4
+#define DOOR_PORT 1
+#define DOOR_TYPE 2
+
+static uint32_t random_state = 7;
+
+static uint32_t random_next( void ) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return random_state;
+}
+
+static uint32_t to_timestamp( uint32_t seconds ) {
+    seconds %= 7 * SECONDS_PER_DAY;
+
+    return ((seconds / SECONDS_PER_DAY) << 17) | (seconds % SECONDS_PER_DAY);
+}
+
+static void reset( void ) {
+    init_message_queue();
+    host_time_us = 0;
+    host_network_reset(1);
+    transfer_state = TRANSFER_IDLE;
+    ack_rtt_sampled = false;
+    retry_timeout_s = MESSAGE_TIMEOUT_US / 1000000;
+    retry_tokens = RETRY_BUDGET;
+    retry_tokens_time = 0;
+    send_retry_time = 0;
+    while (pop_due_task(UINT64_MAX) >= 0);
+
+    join();
+    sync_time(true);
+
+    // Whatever reserve hands out, it's the same buffer every time
+    tx_buffer = lorawan_tx_reserve(MAX_FRAME_PAYLOAD_SIZE);
+    CHECK(tx_buffer != NULL);
+}
+
+// A door message at a time, each one acked before the next is queued
+static void queue_single_alarm( int index ) {
+    uint8_t door_open = index & 1;
+
+    create_message_entry(DOOR_PORT, MESSAGE_PRIORITY_ALARM, true, DOOR_TYPE, &door_open, 1);
+}
+
+// A backlog of guaranteed 7 byte messages, which never go into a series
+static void queue_plain_backlog( void ) {
+    uint8_t content[7];
+
+    for (int i = 0; i < 150; i++) {
+        for (int j = 0; j < sizeof(content); j++) {
+            content[j] = random_next();
+        }
+        create_message_entry_at(to_timestamp(i * 60), DOOR_PORT, MESSAGE_PRIORITY_TELEMETRY, true, 1 + i % 8, &content[0], sizeof(content));
+    }
+}
+
+// A backlog of temperature summaries every three minutes, packed as series
+static void queue_temperature_backlog( void ) {
+    uint8_t content[7];
+    int mean = 215;
+
+    for (int i = 0; i < 200; i++) {
+        mean += (int) (random_next() % 5) - 2;
+        int16_t min = mean - (int) (random_next() % 7);
+        int16_t max = mean + (int) (random_next() % 7);
+        content[0] = (uint16_t) mean >> 8;
+        content[1] = (uint16_t) mean & 0xFF;
+        content[2] = (uint16_t) min >> 8;
+        content[3] = (uint16_t) min & 0xFF;
+        content[4] = (uint16_t) max >> 8;
+        content[5] = (uint16_t) max & 0xFF;
+        content[6] = random_next() % 5;
+        create_message_entry_at(to_timestamp(i * 180), TEMPERATURE_PORT, MESSAGE_PRIORITY_TELEMETRY, false, TEMPERATURE_TYPE, &content[0], sizeof(content));
+    }
+}
+
+struct copy_totals {
+    uint32_t uplinks;
+    uint64_t payload_bytes;  // sent, written once into the transmit buffer
+    uint64_t packed_bytes;   // copied into the transmit buffer by memcpy()
+    uint64_t other_bytes;    // copied anywhere else while sending
+    uint64_t library_bytes;  // copied by the library into the MAC frame buffer
+};
+
+// Runs the main loop until the queue is empty and adds up the copies per uplink
+static void send_all( struct copy_totals* totals ) {
+    uint32_t iterations = 0;
+
+    while (queued_message_count() > 0) {
+        CHECK(++iterations < 100000);
+
+        uint32_t uplinks = host_network_stats.uplinks;
+        uint64_t payload_bytes = host_network_stats.payload_bytes;
+        uint64_t library_bytes = host_network_stats.copied_bytes;
+        packed_copy_bytes = 0;
+        other_copy_bytes = 0;
+
+        transfer_data_step();
+
+        if (host_network_stats.uplinks != uplinks) {
+            CHECK(host_network_stats.uplinks == uplinks + 1);
+            uint64_t frame_bytes = host_network_stats.payload_bytes - payload_bytes;
+
+            // Nothing is packed twice or past the end of the frame
+            CHECK(packed_copy_bytes <= frame_bytes);
+
+            totals->uplinks++;
+            totals->payload_bytes += frame_bytes;
+            totals->packed_bytes += packed_copy_bytes;
+            totals->other_bytes += other_copy_bytes;
+            totals->library_bytes += host_network_stats.copied_bytes - library_bytes;
+        } else {
+            CHECK(packed_copy_bytes == 0);
+        }
+
+        int task;
+        while ((task = pop_due_task(get_us_since_boot())) >= 0) {
+            run_task(task);
+        }
+        lorawan_process_timeout_ms(MAX_SLEEP_MS);
+    }
+}
+
+static void report( const char* name, const struct copy_totals* totals ) {
+    double uplinks = totals->uplinks;
+
+    printf("%-22s %4u uplinks, per uplink: payload %6.1f B, copied in place %6.1f B, encoded in place %6.1f B, "
+           "copied elsewhere %6.1f B, library copy %6.1f B\n",
+        name, totals->uplinks, totals->payload_bytes / uplinks, totals->packed_bytes / uplinks,
+        (totals->payload_bytes - totals->packed_bytes) / uplinks, totals->other_bytes / uplinks,
+        totals->library_bytes / uplinks);
+}
+
+int main( void ) {
+    struct copy_totals totals;
+
+    reset();
+    memset(&totals, 0, sizeof(totals));
+    for (int i = 0; i < 50; i++) {
+        queue_single_alarm(i);
+        send_all(&totals);
+    }
+    CHECK(totals.uplinks == 50);
+    CHECK(totals.payload_bytes == 50 * 5);
+    CHECK(totals.packed_bytes == totals.payload_bytes);
+    CHECK(totals.other_bytes == 0);
+    report("single alarm", &totals);
+
+    reset();
+    memset(&totals, 0, sizeof(totals));
+    queue_plain_backlog();
+    send_all(&totals);
+    CHECK(totals.payload_bytes == 150 * 11);
+    CHECK(totals.packed_bytes == totals.payload_bytes);
+    CHECK(totals.other_bytes == 0);
+    report("plain record backlog", &totals);
+
+    reset();
+    memset(&totals, 0, sizeof(totals));
+    queue_temperature_backlog();
+    send_all(&totals);
+    CHECK(totals.packed_bytes < totals.payload_bytes);
+    CHECK(totals.payload_bytes < 200 * 11);
+    CHECK(totals.other_bytes == 0);
+    report("temperature backlog", &totals);
+
+    return 0;
+}
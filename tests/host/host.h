@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Controls for the host stand-ins of the Pico SDK and pico_lorawan, used by the
+ * tests and benchmarks in this directory.
+ */
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hardware/flash.h"
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+//
+// Simulated time
+//
+// get_absolute_time() and friends return host_time_us, which only moves when a
+// test advances it or when the code under test sleeps.
+//
+extern volatile uint64_t host_time_us;
+
+void host_advance_us( uint64_t us );
+
+// An interrupt, or the other core sending an event, at host_interrupt_time_us.
+// best_effort_wfe_or_timeout() calls host_interrupt and wakes up early once it
+// sleeps past that time, then forgets about it
+extern uint64_t host_interrupt_time_us;
+extern void (*host_interrupt)( void );
+
+//
+// ADC
+//
+// Every conversion returns host_adc_sample(), by default host_adc_raw.
+//
+extern uint16_t host_adc_raw;
+extern uint16_t (*host_adc_sample)( void );
+
+//
+// GPIO
+//
+extern bool host_gpio_level[30];
+
+// Monotonic wall clock for benchmarks
+uint64_t host_wall_clock_ns( void );
+
+//
+// Network
+//
+// lorawan_host.c stands in for pico_lorawan. Uplinks go to a simulated network
+// server that loses them with probability uplink_loss. For every uplink it does
+// receive it calls on_record for each record in the frame and, if ack_guaranteed
+// is set, echoes the headers of the guaranteed records back in a downlink on the
+// same port, which is lost with probability downlink_loss. The uplink completes
+// rx_window_ms after it was committed.
+//
+struct host_network {
+    double uplink_loss;
+    double downlink_loss;
+    bool ack_guaranteed;
+    uint32_t rx_window_ms;
+    int max_payload_size;
+    void (*on_record)( uint8_t f_port, uint32_t header, const uint8_t* content, uint8_t content_length );
+};
+
+struct host_network_stats {
+    uint32_t uplinks;
+    uint32_t uplinks_lost;
+    uint32_t downlinks;
+    uint32_t downlinks_lost;
+    uint32_t records;
+    uint64_t payload_bytes; // committed by the application
+    uint64_t copied_bytes;  // copied by the library on the way to the radio
+};
+
+extern struct host_network host_network;
+extern struct host_network_stats host_network_stats;
+
+// Back to a lossless network that acks guaranteed records, with no uplink in
+// flight and cleared stats. The loss draws are seeded with seed
+void host_network_reset( unsigned seed );
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Conversions come from host_adc_sample(), see host.h.
+ */
+
+#ifndef _HARDWARE_ADC_H
+#define _HARDWARE_ADC_H
+
+#include "pico/stdlib.h"
+
+#define DREQ_ADC 36
+
+typedef struct {
+    volatile uint32_t fifo;
+} adc_hw_t;
+
+extern adc_hw_t* adc_hw;
+
+void adc_init( void );
+void adc_set_temp_sensor_enabled( bool enable );
+void adc_select_input( uint input );
+uint16_t adc_read( void );
+void adc_fifo_setup( bool en, bool dreq_en, uint16_t dreq_thresh, bool err_in_fifo, bool byte_shift );
+void adc_set_clkdiv( float clkdiv );
+void adc_run( bool run );
+void adc_fifo_drain( void );
+
+#endif
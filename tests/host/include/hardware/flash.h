@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Flash is a RAM array that behaves like NOR flash: programming can only clear
+ * bits and erasing sets a whole sector back to 0xFF.
+ */
+
+#ifndef _HARDWARE_FLASH_H
+#define _HARDWARE_FLASH_H
+
+#include "pico/stdlib.h"
+
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+
+extern uint8_t host_flash[PICO_FLASH_SIZE_BYTES];
+#define XIP_BASE ((uintptr_t) host_flash)
+
+void flash_range_erase( uint32_t flash_offs, size_t count );
+void flash_range_program( uint32_t flash_offs, const uint8_t* data, size_t count );
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _HARDWARE_GPIO_H
+#define _HARDWARE_GPIO_H
+
+#include "pico/stdlib.h"
+
+#define GPIO_IN false
+#define GPIO_OUT true
+
+#define GPIO_IRQ_LEVEL_LOW 0x1u
+#define GPIO_IRQ_LEVEL_HIGH 0x2u
+#define GPIO_IRQ_EDGE_FALL 0x4u
+#define GPIO_IRQ_EDGE_RISE 0x8u
+
+#define IO_IRQ_BANK0 13
+
+typedef void (*gpio_irq_callback_t)( uint gpio, uint32_t event_mask );
+typedef void (*irq_handler_t)( void );
+
+void gpio_init( uint gpio );
+void gpio_set_dir( uint gpio, bool out );
+void gpio_pull_up( uint gpio );
+void gpio_put( uint gpio, bool value );
+bool gpio_get( uint gpio );
+void gpio_set_irq_enabled( uint gpio, uint32_t event_mask, bool enabled );
+void gpio_set_irq_enabled_with_callback( uint gpio, uint32_t event_mask, bool enabled, gpio_irq_callback_t callback );
+void gpio_add_raw_irq_handler_masked( uint32_t gpio_mask, irq_handler_t handler );
+uint32_t gpio_get_irq_event_mask( uint gpio );
+void gpio_acknowledge_irq( uint gpio, uint32_t event_mask );
+void irq_set_enabled( uint num, bool enabled );
+
+#endif
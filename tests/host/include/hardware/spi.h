@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _HARDWARE_SPI_H
+#define _HARDWARE_SPI_H
+
+#include "pico/stdlib.h"
+
+typedef struct spi_inst {
+    int unused;
+} spi_inst_t;
+
+extern spi_inst_t spi0_inst;
+#define spi0 (&spi0_inst)
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _HARDWARE_SYNC_H
+#define _HARDWARE_SYNC_H
+
+#include "pico/stdlib.h"
+
+uint32_t save_and_disable_interrupts( void );
+void restore_interrupts( uint32_t status );
+
+#endif
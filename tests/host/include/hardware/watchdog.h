@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _HARDWARE_WATCHDOG_H
+#define _HARDWARE_WATCHDOG_H
+
+#include "pico/stdlib.h"
+
+// Aborts, a test that ends up resetting the Pico has failed
+void watchdog_enable( uint32_t delay_ms, bool pause_on_debug );
+
+#endif
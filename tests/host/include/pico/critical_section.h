@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Critical sections are mutexes on the host, so that tests can run the two
+ * cores as threads.
+ */
+
+#ifndef _PICO_CRITICAL_SECTION_H
+#define _PICO_CRITICAL_SECTION_H
+
+#include <pthread.h>
+
+typedef struct critical_section {
+    pthread_mutex_t mutex;
+} critical_section_t;
+
+void critical_section_init( critical_section_t* crit_sec );
+void critical_section_enter_blocking( critical_section_t* crit_sec );
+void critical_section_exit( critical_section_t* crit_sec );
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _PICO_MULTICORE_H
+#define _PICO_MULTICORE_H
+
+#include "pico/stdlib.h"
+
+void multicore_launch_core1( void (*entry)(void) );
+void multicore_lockout_victim_init( void );
+bool multicore_lockout_victim_is_initialized( uint core_num );
+void multicore_lockout_start_blocking( void );
+void multicore_lockout_end_blocking( void );
+
+#endif
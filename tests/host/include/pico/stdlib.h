@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Host stand-in for the parts of the Pico SDK that the temperature_led example
+ * uses. Time is simulated, see host.h.
+ */
+
+#ifndef _PICO_STDLIB_H
+#define _PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+#define PICO_DEFAULT_SPI_INSTANCE spi0
+#define PICO_DEFAULT_SPI_TX_PIN 19
+#define PICO_DEFAULT_SPI_RX_PIN 16
+#define PICO_DEFAULT_SPI_SCK_PIN 18
+#define PICO_DEFAULT_LED_PIN 25
+
+#define __not_in_flash_func(func_name) func_name
+#define __sev() do {} while (0)
+#define __wfe() do {} while (0)
+#define __dmb() __sync_synchronize()
+
+static inline uint64_t to_us_since_boot( absolute_time_t t ) {
+    return t;
+}
+
+absolute_time_t get_absolute_time( void );
+absolute_time_t make_timeout_time_us( uint64_t us );
+absolute_time_t make_timeout_time_ms( uint32_t ms );
+bool best_effort_wfe_or_timeout( absolute_time_t timeout_timestamp );
+uint64_t time_us_64( void );
+uint32_t time_us_32( void );
+void sleep_ms( uint32_t ms );
+bool stdio_init_all( void );
+void tight_loop_contents( void );
+uint get_core_num( void );
+
+#include "hardware/gpio.h"
+
+#endif
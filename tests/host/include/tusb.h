@@ -0,0 +1,10 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _TUSB_H_
+#define _TUSB_H_
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Host stand-in for pico_lorawan (src/lorawan.c) on top of a simulated network,
+ * see host.h. Joining always succeeds at once, there are no duty cycle limits and
+ * the MAC never has commands of its own to send.
+ */
+
+#include <string.h>
+
+#include "pico/lorawan.h"
+
+#include "host.h"
+
+#define LORAWAN_APP_DATA_BUFFER_MAX_SIZE 242
+#define HOST_RX_QUEUE_DEPTH 4
+
+struct host_downlink {
+    uint8_t port;
+    uint8_t length;
+    uint8_t buffer[LORAWAN_APP_DATA_BUFFER_MAX_SIZE];
+};
+
+struct host_network host_network;
+struct host_network_stats host_network_stats;
+
+static uint32_t random_state = 1;
+
+static bool joined = false;
+static bool tx_in_flight = false;
+static uint64_t tx_done_time = 0;
+static struct lorawan_tx_status tx_status;
+static struct host_downlink tx_downlink; // answer to the uplink in flight, if length > 0
+static lorawan_tx_callback_t tx_callback = NULL;
+static void* tx_context = NULL;
+
+static uint8_t app_data_buffer[LORAWAN_APP_DATA_BUFFER_MAX_SIZE];
+static uint8_t tx_reserve_size = 0;
+static uint8_t mac_buffer[LORAWAN_APP_DATA_BUFFER_MAX_SIZE];
+
+static struct host_downlink rx_queue[HOST_RX_QUEUE_DEPTH];
+static uint8_t rx_queue_head = 0;
+static uint8_t rx_queue_count = 0;
+static uint32_t downlink_count = 0;
+static uint32_t uplink_counter = 0;
+
+void host_network_reset( unsigned seed ) {
+    memset(&host_network, 0, sizeof(host_network));
+    host_network.ack_guaranteed = true;
+    host_network.rx_window_ms = 2000;
+    host_network.max_payload_size = 242;
+
+    memset(&host_network_stats, 0, sizeof(host_network_stats));
+    random_state = seed ? seed : 1;
+
+    tx_in_flight = false;
+    tx_callback = NULL;
+    tx_downlink.length = 0;
+    tx_reserve_size = 0;
+    rx_queue_head = 0;
+    rx_queue_count = 0;
+    downlink_count = 0;
+    uplink_counter = 0;
+}
+
+static double random_unit( void ) {
+    // xorshift32, so that runs are reproducible on every host
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return (random_state >> 8) / (double) (1 << 24);
+}
+
+static uint32_t read_header( const uint8_t* buffer ) {
+    return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t) buffer[3] << 24);
+}
+
+// What the network server does with an uplink that made it. The ack goes out in
+// the RX windows, so it only shows up once the uplink completes
+static void receive_uplink( const uint8_t* data, uint8_t data_len, uint8_t app_port ) {
+    struct host_downlink* ack = &tx_downlink;
+    int offset = 0;
+
+    ack->port = app_port;
+    ack->length = 0;
+
+    while (offset + 4 <= data_len) {
+        uint32_t header = read_header(&data[offset]);
+        // Series records (version 1) count their content in 4 byte words
+        int content_length = (header >> 29) == 1 ? (header & 0x0F) * 4 : (header & 0x0F);
+
+        if (offset + 4 + content_length > data_len) {
+            break;
+        }
+
+        host_network_stats.records++;
+        if (host_network.on_record != NULL) {
+            host_network.on_record(app_port, header, &data[offset + 4], content_length);
+        }
+
+        if (host_network.ack_guaranteed && ((header >> 8) & 0x01) && ack->length + 4 <= sizeof(ack->buffer)) {
+            memcpy(&ack->buffer[ack->length], &data[offset], 4);
+            ack->length += 4;
+        }
+
+        offset += 4 + content_length;
+    }
+
+    if (ack->length == 0) {
+        return;
+    }
+
+    host_network_stats.downlinks++;
+    if (random_unit() < host_network.downlink_loss) {
+        host_network_stats.downlinks_lost++;
+        ack->length = 0;
+    }
+}
+
+static int submit_uplink( const uint8_t* data, uint8_t data_len, uint8_t app_port, uint8_t flags, lorawan_tx_callback_t callback, void* context ) {
+    if (!joined || tx_in_flight || data_len > host_network.max_payload_size) {
+        return -1;
+    }
+
+    // The MAC copies the payload into its frame buffer, see PrepareFrame()
+    memcpy(mac_buffer, data, data_len);
+    host_network_stats.copied_bytes += data_len;
+    host_network_stats.payload_bytes += data_len;
+    host_network_stats.uplinks++;
+
+    tx_downlink.length = 0;
+    memset(&tx_status, 0, sizeof(tx_status));
+    tx_status.result = LORAWAN_TX_OK;
+    tx_status.app_port = app_port;
+    tx_status.confirmed = (flags & LORAWAN_SEND_CONFIRMED) != 0;
+    tx_status.uplink_counter = uplink_counter++;
+    tx_status.time_on_air_ms = lorawan_time_on_air_ms(data_len);
+    tx_status.nb_trans = 1;
+
+    if (random_unit() < host_network.uplink_loss) {
+        host_network_stats.uplinks_lost++;
+    } else {
+        receive_uplink(mac_buffer, data_len, app_port);
+        tx_status.ack_received = tx_status.confirmed;
+    }
+
+    tx_in_flight = true;
+    tx_done_time = host_time_us + host_network.rx_window_ms * 1000ULL;
+    tx_callback = callback;
+    tx_context = context;
+
+    return 0;
+}
+
+int lorawan_init_otaa_binary(const struct lorawan_sx1276_settings* sx1276_settings, LoRaMacRegion_t region, const struct lorawan_otaa_binary_settings* otaa_settings)
+{
+    return 0;
+}
+
+int lorawan_join()
+{
+    joined = true;
+
+    return 0;
+}
+
+int lorawan_is_joined()
+{
+    return joined;
+}
+
+int lorawan_process()
+{
+    if (tx_in_flight && host_time_us >= tx_done_time) {
+        lorawan_tx_callback_t callback = tx_callback;
+
+        tx_in_flight = false;
+        tx_callback = NULL;
+        if (tx_downlink.length > 0) {
+            if (rx_queue_count < HOST_RX_QUEUE_DEPTH) {
+                rx_queue[(rx_queue_head + rx_queue_count) % HOST_RX_QUEUE_DEPTH] = tx_downlink;
+                rx_queue_count++;
+            }
+            downlink_count++;
+            tx_downlink.length = 0;
+        }
+        if (callback != NULL) {
+            callback(&tx_status, tx_context);
+        }
+
+        return 0;
+    }
+
+    return rx_queue_count > 0 ? 0 : 1;
+}
+
+int lorawan_process_timeout_ms(uint32_t timeout_ms)
+{
+    return lorawan_process_timeout_ms_until(timeout_ms, NULL, NULL);
+}
+
+int lorawan_process_timeout_ms_until(uint32_t timeout_ms, lorawan_wake_callback_t wake, void* context)
+{
+    uint64_t timeout_time = host_time_us + timeout_ms * 1000ULL;
+
+    while (1) {
+        if (lorawan_process() == 0) {
+            return 0;
+        }
+        if (wake != NULL && wake(context)) {
+            return 0;
+        }
+        if (host_time_us >= timeout_time) {
+            return 1;
+        }
+
+        // The radio IRQ for the end of the uplink cycle wakes us up too
+        best_effort_wfe_or_timeout(tx_in_flight && tx_done_time < timeout_time ? tx_done_time : timeout_time);
+    }
+}
+
+int lorawan_send_unconfirmed(const void* data, uint8_t data_len, uint8_t app_port)
+{
+    return submit_uplink(data, data_len, app_port, 0, NULL, NULL);
+}
+
+int lorawan_send_confirmed(const void* data, uint8_t data_len, uint8_t app_port, lorawan_tx_callback_t callback, void* context)
+{
+    return submit_uplink(data, data_len, app_port, LORAWAN_SEND_CONFIRMED, callback, context);
+}
+
+int lorawan_send_async(const void* data, uint8_t data_len, uint8_t app_port, uint8_t flags, lorawan_tx_callback_t callback, void* context)
+{
+    return submit_uplink(data, data_len, app_port, flags, callback, context);
+}
+
+uint8_t* lorawan_tx_reserve(uint8_t data_len)
+{
+    if (data_len > sizeof(app_data_buffer)) {
+        return NULL;
+    }
+
+    tx_reserve_size = data_len;
+
+    return app_data_buffer;
+}
+
+int lorawan_tx_commit(uint8_t data_len, uint8_t app_port, uint8_t flags, lorawan_tx_callback_t callback, void* context)
+{
+    uint8_t reserved = tx_reserve_size;
+
+    tx_reserve_size = 0;
+
+    if (data_len > reserved) {
+        return -1;
+    }
+
+    return submit_uplink(app_data_buffer, data_len, app_port, flags, callback, context);
+}
+
+int lorawan_is_tx_pending()
+{
+    return tx_in_flight;
+}
+
+int lorawan_is_busy()
+{
+    return tx_in_flight;
+}
+
+int lorawan_max_payload_size()
+{
+    return host_network.max_payload_size;
+}
+
+int lorawan_duty_cycle_wait_ms()
+{
+    return 0;
+}
+
+int lorawan_time_on_air_ms(uint8_t data_len)
+{
+    // Roughly SF10 at 125 kHz
+    return 250 + data_len * 8;
+}
+
+int lorawan_receive(void* data, uint8_t data_len, uint8_t* app_port)
+{
+    struct lorawan_rx_info info;
+    int receive_length = lorawan_receive_info(data, data_len, &info);
+
+    if (receive_length >= 0) {
+        *app_port = info.app_port;
+    }
+
+    return receive_length;
+}
+
+int lorawan_receive_info(void* data, uint8_t data_len, struct lorawan_rx_info* info)
+{
+    if (rx_queue_count == 0) {
+        return -1;
+    }
+
+    struct host_downlink* downlink = &rx_queue[rx_queue_head];
+    if (downlink->length > data_len) {
+        return -1;
+    }
+
+    memcpy(data, downlink->buffer, downlink->length);
+    memset(info, 0, sizeof(*info));
+    info->app_port = downlink->port;
+    info->downlink_counter = downlink_count;
+
+    rx_queue_head = (rx_queue_head + 1) % HOST_RX_QUEUE_DEPTH;
+    rx_queue_count--;
+
+    return downlink->length;
+}
+
+int lorawan_receive_pending()
+{
+    return rx_queue_count;
+}
+
+uint32_t lorawan_downlink_count()
+{
+    return downlink_count;
+}
+
+int lorawan_request_time()
+{
+    return 0;
+}
+
+int lorawan_receive_time(uint32_t* seconds, uint16_t* milliseconds)
+{
+    return -1;
+}
+
+void lorawan_debug(bool debug)
+{
+}
+
+int lorawan_erase_nvm()
+{
+    return 0;
+}
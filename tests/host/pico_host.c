@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Host implementation of the Pico SDK stand-ins in include/.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "pico/multicore.h"
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/gpio.h"
+#include "hardware/spi.h"
+#include "hardware/sync.h"
+#include "hardware/watchdog.h"
+#include "systime.h"
+
+#include "host.h"
+
+// Linker symbols that the RAM budget report takes addresses of
+char __StackLimit, __bss_end__, __data_start__, __end__;
+
+volatile uint64_t host_time_us = 0;
+
+void host_advance_us( uint64_t us ) {
+    host_time_us += us;
+}
+
+uint64_t host_wall_clock_ns( void ) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+absolute_time_t get_absolute_time( void ) {
+    return host_time_us;
+}
+
+absolute_time_t make_timeout_time_us( uint64_t us ) {
+    return host_time_us + us;
+}
+
+absolute_time_t make_timeout_time_ms( uint32_t ms ) {
+    return host_time_us + ms * 1000ULL;
+}
+
+uint64_t host_interrupt_time_us = UINT64_MAX;
+void (*host_interrupt)( void ) = NULL;
+
+bool best_effort_wfe_or_timeout( absolute_time_t timeout_timestamp ) {
+    if (host_interrupt != NULL && host_interrupt_time_us <= timeout_timestamp) {
+        void (*interrupt)( void ) = host_interrupt;
+
+        if (host_interrupt_time_us > host_time_us) {
+            host_time_us = host_interrupt_time_us;
+        }
+        host_interrupt = NULL;
+        host_interrupt_time_us = UINT64_MAX;
+        interrupt();
+
+        return false;
+    }
+
+    if (timeout_timestamp > host_time_us) {
+        host_time_us = timeout_timestamp;
+    }
+
+    return true;
+}
+
+uint64_t time_us_64( void ) {
+    return host_time_us;
+}
+
+uint32_t time_us_32( void ) {
+    return (uint32_t) host_time_us;
+}
+
+void sleep_ms( uint32_t ms ) {
+    host_advance_us(ms * 1000ULL);
+}
+
+bool stdio_init_all( void ) {
+    return true;
+}
+
+void tight_loop_contents( void ) {
+}
+
+uint get_core_num( void ) {
+    return 0;
+}
+
+void critical_section_init( critical_section_t* crit_sec ) {
+    pthread_mutex_init(&crit_sec->mutex, NULL);
+}
+
+void critical_section_enter_blocking( critical_section_t* crit_sec ) {
+    pthread_mutex_lock(&crit_sec->mutex);
+}
+
+void critical_section_exit( critical_section_t* crit_sec ) {
+    pthread_mutex_unlock(&crit_sec->mutex);
+}
+
+void multicore_launch_core1( void (*entry)(void) ) {
+}
+
+void multicore_lockout_victim_init( void ) {
+}
+
+bool multicore_lockout_victim_is_initialized( uint core_num ) {
+    return false;
+}
+
+void multicore_lockout_start_blocking( void ) {
+}
+
+void multicore_lockout_end_blocking( void ) {
+}
+
+uint32_t save_and_disable_interrupts( void ) {
+    return 0;
+}
+
+void restore_interrupts( uint32_t status ) {
+}
+
+void watchdog_enable( uint32_t delay_ms, bool pause_on_debug ) {
+    fprintf(stderr, "watchdog reset\n");
+    abort();
+}
+
+spi_inst_t spi0_inst;
+
+//
+// GPIO
+//
+bool host_gpio_level[30];
+
+void gpio_init( uint gpio ) {
+}
+
+void gpio_set_dir( uint gpio, bool out ) {
+}
+
+void gpio_pull_up( uint gpio ) {
+    host_gpio_level[gpio] = true;
+}
+
+void gpio_put( uint gpio, bool value ) {
+    host_gpio_level[gpio] = value;
+}
+
+bool gpio_get( uint gpio ) {
+    return host_gpio_level[gpio];
+}
+
+void gpio_set_irq_enabled( uint gpio, uint32_t event_mask, bool enabled ) {
+}
+
+void gpio_set_irq_enabled_with_callback( uint gpio, uint32_t event_mask, bool enabled, gpio_irq_callback_t callback ) {
+}
+
+void gpio_add_raw_irq_handler_masked( uint32_t gpio_mask, irq_handler_t handler ) {
+}
+
+uint32_t gpio_get_irq_event_mask( uint gpio ) {
+    return 0;
+}
+
+void gpio_acknowledge_irq( uint gpio, uint32_t event_mask ) {
+}
+
+void irq_set_enabled( uint num, bool enabled ) {
+}
+
+//
+// ADC and DMA
+//
+uint16_t host_adc_raw = 0;
+
+static uint16_t host_adc_raw_sample( void ) {
+    return host_adc_raw;
+}
+
+uint16_t (*host_adc_sample)( void ) = host_adc_raw_sample;
+
+static adc_hw_t host_adc_hw;
+adc_hw_t* adc_hw = &host_adc_hw;
+
+void adc_init( void ) {
+}
+
+void adc_set_temp_sensor_enabled( bool enable ) {
+}
+
+void adc_select_input( uint input ) {
+}
+
+uint16_t adc_read( void ) {
+    return host_adc_sample();
+}
+
+void adc_fifo_setup( bool en, bool dreq_en, uint16_t dreq_thresh, bool err_in_fifo, bool byte_shift ) {
+}
+
+void adc_set_clkdiv( float clkdiv ) {
+}
+
+void adc_run( bool run ) {
+}
+
+void adc_fifo_drain( void ) {
+}
+
+int dma_claim_unused_channel( bool required ) {
+    return 0;
+}
+
+dma_channel_config dma_channel_get_default_config( uint channel ) {
+    dma_channel_config config = { .ctrl = DMA_SIZE_32 };
+
+    return config;
+}
+
+void channel_config_set_transfer_data_size( dma_channel_config* c, enum dma_channel_transfer_size size ) {
+    c->ctrl = size;
+}
+
+void channel_config_set_read_increment( dma_channel_config* c, bool incr ) {
+}
+
+void channel_config_set_write_increment( dma_channel_config* c, bool incr ) {
+}
+
+void channel_config_set_dreq( dma_channel_config* c, uint dreq ) {
+}
+
+void dma_channel_configure( uint channel, const dma_channel_config* config, volatile void* write_addr,
+                            const volatile void* read_addr, uint transfer_count, bool trigger ) {
+    if (!trigger || read_addr != &adc_hw->fifo) {
+        return;
+    }
+
+    for (uint i = 0; i < transfer_count; i++) {
+        uint16_t sample = host_adc_sample();
+
+        switch (config->ctrl) {
+            case DMA_SIZE_8:
+                ((volatile uint8_t*) write_addr)[i] = sample >> 4;
+                break;
+            case DMA_SIZE_16:
+                ((volatile uint16_t*) write_addr)[i] = sample;
+                break;
+            default:
+                ((volatile uint32_t*) write_addr)[i] = sample;
+                break;
+        }
+    }
+}
+
+void dma_channel_wait_for_finish_blocking( uint channel ) {
+}
+
+//
+// Flash
+//
+uint8_t host_flash[PICO_FLASH_SIZE_BYTES];
+
+void flash_range_erase( uint32_t flash_offs, size_t count ) {
+    CHECK(flash_offs % FLASH_SECTOR_SIZE == 0 && count % FLASH_SECTOR_SIZE == 0);
+    CHECK(flash_offs + count <= PICO_FLASH_SIZE_BYTES);
+
+    memset(&host_flash[flash_offs], 0xFF, count);
+}
+
+void flash_range_program( uint32_t flash_offs, const uint8_t* data, size_t count ) {
+    CHECK(flash_offs % FLASH_PAGE_SIZE == 0 && count % FLASH_PAGE_SIZE == 0);
+    CHECK(flash_offs + count <= PICO_FLASH_SIZE_BYTES);
+
+    for (size_t i = 0; i < count; i++) {
+        host_flash[flash_offs + i] &= data[i];
+    }
+}
+
+//
+// LoRaMac-node system time, only used for debug output
+//
+void SysTimeLocalTime( const uint32_t timestamp, struct tm* localtime ) {
+    time_t seconds = timestamp;
+
+    gmtime_r(&seconds, localtime);
+}
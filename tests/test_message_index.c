@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Ack index: colliding keys, wrap around at the end of the table, backward shift
+ * deletion out of the middle of a probe run, and acks that arrive for a message
+ * that has already left the queue.
+ */
+
+#define main temperature_led_main
+#include "../src/temperature_led/main.c"
+#undef main
+
+#include "host.h"
+
+#define TEST_PORT 1
+#define TEST_TYPE 4 // temperature, unguaranteed
+#define DOOR_TYPE 2 // door 0, guaranteed
+
+static uint8_t test_content[3] = { 1, 2, 3 };
+
+// Every bucket between an entry's home bucket and its bucket must be in use, or
+// a lookup would stop short of it
+static void check_index( void ) {
+    uint32_t used = 0;
+
+    for (uint32_t bucket = 0; bucket < MESSAGE_INDEX_SIZE; bucket++) {
+        if (message_index[bucket] == MESSAGE_INDEX_EMPTY) {
+            continue;
+        }
+
+        struct message_entry* message = &message_pool[message_index[bucket]];
+        CHECK(!is_message_entry_free(message));
+
+        for (uint32_t probe = message_index_home(message); probe != bucket; probe = (probe + 1) & (MESSAGE_INDEX_SIZE - 1)) {
+            CHECK(message_index[probe] != MESSAGE_INDEX_EMPTY);
+        }
+        used++;
+    }
+
+    CHECK(used == queued_message_count());
+}
+
+static struct message_entry* match( uint32_t timestamp ) {
+    return match_message_by_header(MESSAGE_VERSION, TEST_PORT, false, TEST_TYPE, timestamp);
+}
+
+static void create( uint32_t timestamp ) {
+    create_message_entry_at(timestamp, TEST_PORT, MESSAGE_PRIORITY_TELEMETRY, false, TEST_TYPE, test_content, sizeof(test_content));
+}
+
+// Fills timestamps with count keys whose home bucket is bucket
+static void find_colliding_timestamps( uint32_t bucket, uint32_t* timestamps, int count ) {
+    int found = 0;
+
+    for (uint32_t timestamp = 0; timestamp <= 0xFFFFF && found < count; timestamp++) {
+        if (message_index_hash(TEST_PORT, false, TEST_TYPE, timestamp) == bucket) {
+            timestamps[found++] = timestamp;
+        }
+    }
+
+    CHECK(found == count);
+}
+
+static void test_collisions( void ) {
+    uint32_t timestamps[8];
+
+    init_message_queue();
+    find_colliding_timestamps(17, timestamps, 8);
+
+    for (int i = 0; i < 8; i++) {
+        create(timestamps[i]);
+    }
+    check_index();
+
+    // They all share bucket 17, so they take up 17..24 in insertion order
+    for (int i = 0; i < 8; i++) {
+        CHECK(message_index[17 + i] != MESSAGE_INDEX_EMPTY);
+        struct message_entry* message = match(timestamps[i]);
+        CHECK(message != NULL && message_timestamp(message) == timestamps[i]);
+    }
+
+    // Same bucket but a different key
+    uint32_t other[9];
+    find_colliding_timestamps(17, other, 9);
+    CHECK(match(other[8]) == NULL);
+    // Same timestamp but a different port, type or delivery
+    CHECK(match_message_by_header(MESSAGE_VERSION, TEST_PORT + 1, false, TEST_TYPE, timestamps[0]) == NULL);
+    CHECK(match_message_by_header(MESSAGE_VERSION, TEST_PORT, true, TEST_TYPE, timestamps[0]) == NULL);
+    CHECK(match_message_by_header(MESSAGE_VERSION, TEST_PORT, false, TEST_TYPE + 1, timestamps[0]) == NULL);
+}
+
+static void test_wrap_around( void ) {
+    uint32_t last[3];
+    uint32_t first[2];
+
+    init_message_queue();
+    find_colliding_timestamps(MESSAGE_INDEX_SIZE - 1, last, 3);
+    find_colliding_timestamps(0, first, 2);
+
+    // The run that starts in the last bucket wraps around to 0 and 1, pushing the
+    // keys that live in bucket 0 to 2 and 3
+    for (int i = 0; i < 3; i++) {
+        create(last[i]);
+    }
+    for (int i = 0; i < 2; i++) {
+        create(first[i]);
+    }
+    check_index();
+    CHECK(message_index[3] != MESSAGE_INDEX_EMPTY);
+
+    // Removing the key in the last bucket shifts the wrapped run back across the end
+    cleanup_message(match(last[0]));
+    check_index();
+    CHECK(match(last[0]) == NULL);
+    CHECK(message_index[3] == MESSAGE_INDEX_EMPTY);
+    for (int i = 1; i < 3; i++) {
+        CHECK(match(last[i]) != NULL);
+    }
+    for (int i = 0; i < 2; i++) {
+        CHECK(match(first[i]) != NULL);
+    }
+}
+
+static void test_remove_from_probe_run( void ) {
+    uint32_t home_40[4];
+    uint32_t home_42[2];
+
+    init_message_queue();
+    find_colliding_timestamps(40, home_40, 4);
+    find_colliding_timestamps(42, home_42, 2);
+
+    // 40..45: a a a a b b, where the b keys were displaced from 42
+    for (int i = 0; i < 4; i++) {
+        create(home_40[i]);
+    }
+    for (int i = 0; i < 2; i++) {
+        create(home_42[i]);
+    }
+    check_index();
+
+    // Take out the middle of the run, everything after it moves up one bucket:
+    // 40..44 a a a b b
+    cleanup_message(match(home_40[1]));
+    check_index();
+    CHECK(match(home_40[1]) == NULL);
+    CHECK(message_index[45] == MESSAGE_INDEX_EMPTY);
+    CHECK(message_index_home(&message_pool[message_index[42]]) == 40);
+    CHECK(message_index_home(&message_pool[message_index[43]]) == 42);
+
+    // And the front of the run, then the rest in reverse
+    cleanup_message(match(home_40[0]));
+    check_index();
+    for (int i = 1; i >= 0; i--) {
+        CHECK(match(home_42[i]) != NULL);
+        cleanup_message(match(home_42[i]));
+        check_index();
+    }
+    for (int i = 3; i >= 2; i--) {
+        CHECK(match(home_40[i]) != NULL);
+        cleanup_message(match(home_40[i]));
+        check_index();
+    }
+
+    for (uint32_t bucket = 0; bucket < MESSAGE_INDEX_SIZE; bucket++) {
+        CHECK(message_index[bucket] == MESSAGE_INDEX_EMPTY);
+    }
+}
+
+// Random inserts and acks against a list of what should be queued
+static void test_churn( void ) {
+    static uint32_t live[MESSAGE_QUEUE_SIZE];
+    int live_count = 0;
+    uint32_t state = 99;
+
+    init_message_queue();
+
+    for (int i = 0; i < 20000; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        // Keys from a small range so that the runs get long
+        uint32_t timestamp = state % 4096;
+        bool queued = match(timestamp) != NULL;
+
+        if (!queued && live_count < MESSAGE_QUEUE_SIZE && (state >> 20) % 3 != 0) {
+            create(timestamp);
+            live[live_count++] = timestamp;
+        } else if (live_count > 0) {
+            int victim = (state >> 12) % live_count;
+
+            cleanup_message(match(live[victim]));
+            live[victim] = live[--live_count];
+        }
+
+        if (i % 64 == 0) {
+            check_index();
+        }
+    }
+
+    check_index();
+    CHECK(queued_message_count() == (uint32_t) live_count);
+    for (int i = 0; i < live_count; i++) {
+        CHECK(match(live[i]) != NULL);
+    }
+}
+
+static void ack( uint32_t header ) {
+    uint8_t echo[4] = { header & 0xFF, (header >> 8) & 0xFF, (header >> 16) & 0xFF, header >> 24 };
+
+    process_ack(TEST_PORT, &echo[0]);
+}
+
+// An ack for a message that has left the queue must not release whatever took
+// over its entry
+static void test_ack_after_removal( void ) {
+    init_message_queue();
+
+    create(100);
+    struct message_entry* message = match(100);
+    uint32_t header = message->header;
+    cleanup_message(message);
+
+    // Reuses the entry, the pool hands out the lowest free index
+    create(101);
+    CHECK(match(101) == message);
+
+    ack(header);
+    CHECK(match(101) == message);
+    CHECK(queued_message_count() == 1);
+    check_index();
+
+    // A second ack for the same message does nothing either
+    ack(message->header);
+    CHECK(queued_message_count() == 0);
+    ack(message->header);
+    CHECK(queued_message_count() == 0);
+    check_index();
+}
+
+// The same through the transfer state machine: the door message goes out and the
+// network acks it, but the message is evicted before the downlink is processed
+static void test_ack_in_flight( void ) {
+    uint8_t door_open = 1;
+
+    init_message_queue();
+    host_network_reset(1);
+    join();
+    sync_time(true);
+
+    create_message_entry(TEST_PORT, MESSAGE_PRIORITY_ALARM, true, DOOR_TYPE, &door_open, 1);
+    struct message_entry* door = message_queues[MESSAGE_PRIORITY_ALARM];
+    uint32_t door_header = door->header;
+
+    CHECK(transfer_data_step());
+    CHECK(host_network_stats.uplinks == 1 && host_network_stats.downlinks == 1);
+    CHECK(lorawan_receive_pending() == 0);
+    CHECK(door->send_count == 1);
+
+    cleanup_message(door);
+    host_advance_us(1000000);
+    create_message_entry(TEST_PORT, MESSAGE_PRIORITY_ALARM, true, DOOR_TYPE, &door_open, 1);
+    CHECK(message_queues[MESSAGE_PRIORITY_ALARM] == door);
+    CHECK(door->header != door_header);
+
+    // The uplink completes and the stale ack is drained
+    lorawan_process_timeout_ms(host_network.rx_window_ms);
+    CHECK(uplink_done);
+    CHECK(lorawan_receive_pending() == 1);
+    transfer_data_step();
+    CHECK(lorawan_receive_pending() == 0);
+
+    CHECK(queued_message_count() == 1);
+    CHECK(message_queues[MESSAGE_PRIORITY_ALARM] == door);
+    check_index();
+
+    // The new message goes out in the next uplink and its own ack releases it
+    CHECK(transfer_data_step());
+    CHECK(host_network_stats.uplinks == 2);
+    lorawan_process_timeout_ms(host_network.rx_window_ms);
+    transfer_data_step();
+    CHECK(queued_message_count() == 0);
+    check_index();
+}
+
+int main( void ) {
+    test_collisions();
+    test_wrap_around();
+    test_remove_from_probe_run();
+    test_churn();
+    test_ack_after_removal();
+    test_ack_in_flight();
+
+    printf("message index: all tests passed\n");
+
+    return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Message journal on RAM backed flash with NOR semantics: programming can only
+ * clear bits. A reset is simulated by calling message_journal_init() again
+ * without a flush, and a power cut by ignoring every program and erase from a
+ * given point on before doing so.
+ */
+
+#include <string.h>
+
+#include "message_journal.h"
+
+#include "host.h"
+
+#define SECTOR_COUNT 4
+#define SLOTS_PER_SECTOR (MESSAGE_JOURNAL_SECTOR_SIZE / MESSAGE_JOURNAL_RECORD_SIZE)
+#define SLOT_COUNT (SECTOR_COUNT * SLOTS_PER_SECTOR)
+#define MAX_MESSAGES 2048
+
+//
+// RAM flash
+//
+static uint8_t ram_flash[SECTOR_COUNT * MESSAGE_JOURNAL_SECTOR_SIZE];
+static uint32_t erase_count = 0;
+static int32_t writes_until_power_cut = -1; // programs and erases left, -1 for no cut
+
+static bool power_is_on( void ) {
+    if (writes_until_power_cut == 0) {
+        return false;
+    }
+    if (writes_until_power_cut > 0) {
+        writes_until_power_cut--;
+    }
+
+    return true;
+}
+
+static void ram_flash_read( uint32_t offset, uint8_t* data, uint32_t length ) {
+    CHECK(offset + length <= sizeof(ram_flash));
+
+    memcpy(data, &ram_flash[offset], length);
+}
+
+static void ram_flash_program( uint32_t offset, const uint8_t* data, uint32_t length ) {
+    CHECK(offset % MESSAGE_JOURNAL_PAGE_SIZE == 0 && length % MESSAGE_JOURNAL_PAGE_SIZE == 0);
+    CHECK(offset + length <= sizeof(ram_flash));
+
+    if (!power_is_on()) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < length; i++) {
+        ram_flash[offset + i] &= data[i];
+    }
+}
+
+static void ram_flash_erase( uint32_t offset, uint32_t length ) {
+    CHECK(offset % MESSAGE_JOURNAL_SECTOR_SIZE == 0 && length % MESSAGE_JOURNAL_SECTOR_SIZE == 0);
+    CHECK(offset + length <= sizeof(ram_flash));
+
+    if (!power_is_on()) {
+        return;
+    }
+
+    memset(&ram_flash[offset], 0xFF, length);
+    erase_count++;
+}
+
+static const struct message_journal_flash ram_flash_ops = {
+    .sector_count = SECTOR_COUNT,
+    .read         = ram_flash_read,
+    .program      = ram_flash_program,
+    .erase        = ram_flash_erase
+};
+
+//
+// What the application would have queued: a message per header, and the slot
+// its journal record is in
+//
+struct message {
+    bool live;
+    uint16_t slot;
+    uint32_t header;
+};
+static struct message messages[MAX_MESSAGES];
+static uint32_t next_header = 0;
+
+static uint8_t replayed[MAX_MESSAGES];
+static int replayed_count = 0;
+
+static void content_for( uint32_t header, uint8_t* content ) {
+    for (int i = 0; i < 7; i++) {
+        content[i] = header * 7 + i;
+    }
+}
+
+static int relocation_count = 0;
+
+static void on_relocate( uint16_t old_slot, uint16_t new_slot ) {
+    relocation_count++;
+    CHECK(old_slot < SLOT_COUNT);
+    CHECK(new_slot == MESSAGE_JOURNAL_NO_SLOT || new_slot < SLOT_COUNT);
+
+    for (int i = 0; i < MAX_MESSAGES; i++) {
+        if (messages[i].live && messages[i].slot == old_slot) {
+            messages[i].slot = new_slot;
+            return;
+        }
+    }
+}
+
+static void on_replay( uint16_t slot, uint8_t f_port, uint8_t priority, uint32_t header, const uint8_t* content ) {
+    uint8_t expected[7];
+
+    CHECK(slot < SLOT_COUNT);
+    CHECK(header < MAX_MESSAGES);
+    CHECK(f_port == header % 4 + 1);
+    CHECK(priority == header % 3);
+    content_for(header, expected);
+    CHECK(memcmp(content, expected, header % 8) == 0);
+
+    // Every message comes back once, and the application takes the slot it's in
+    CHECK(replayed[header] == 0);
+    replayed[header] = 1;
+    replayed_count++;
+    messages[header].slot = slot;
+}
+
+static void reset( void ) {
+    memset(ram_flash, 0xFF, sizeof(ram_flash));
+    memset(messages, 0, sizeof(messages));
+    next_header = 0;
+    erase_count = 0;
+    writes_until_power_cut = -1;
+    CHECK(message_journal_init(&ram_flash_ops, on_relocate) == 0);
+}
+
+static uint32_t append( void ) {
+    uint32_t header = next_header++;
+    uint8_t content[7];
+
+    CHECK(header < MAX_MESSAGES);
+    content_for(header, content);
+    messages[header].live = true;
+    messages[header].header = header;
+    messages[header].slot = message_journal_append(header % 4 + 1, header % 3, header, content, header % 8);
+    CHECK(messages[header].slot == MESSAGE_JOURNAL_NO_SLOT || messages[header].slot < SLOT_COUNT);
+
+    return header;
+}
+
+static void remove_message( uint32_t header ) {
+    CHECK(messages[header].live);
+    message_journal_remove(messages[header].slot);
+    messages[header].live = false;
+}
+
+static int live_count( void ) {
+    int count = 0;
+
+    for (int i = 0; i < MAX_MESSAGES; i++) {
+        count += messages[i].live;
+    }
+
+    return count;
+}
+
+// Reboots the journal and checks that exactly the live messages come back
+static void restart_and_check( void ) {
+    writes_until_power_cut = -1;
+    memset(replayed, 0, sizeof(replayed));
+    replayed_count = 0;
+
+    CHECK(message_journal_init(&ram_flash_ops, on_relocate) == 0);
+    message_journal_replay(on_replay);
+
+    for (int i = 0; i < MAX_MESSAGES; i++) {
+        CHECK(replayed[i] == messages[i].live);
+    }
+    CHECK(!message_journal_is_dirty());
+}
+
+static void test_append_and_replay( void ) {
+    reset();
+
+    for (int i = 0; i < 40; i++) {
+        append();
+    }
+    CHECK(message_journal_is_dirty());
+    message_journal_flush();
+    CHECK(!message_journal_is_dirty());
+
+    restart_and_check();
+    CHECK(replayed_count == 40);
+}
+
+static void test_tombstones( void ) {
+    reset();
+
+    for (int i = 0; i < 40; i++) {
+        append();
+    }
+    message_journal_flush();
+
+    // Flushed pages, batched tombstones
+    remove_message(0);
+    remove_message(17);
+    remove_message(31);
+    // And one in the page that's still buffered
+    append();
+    remove_message(40);
+    message_journal_flush();
+
+    restart_and_check();
+    CHECK(replayed_count == 37);
+
+    // Removing again after the restart, from the slots the replay handed out
+    remove_message(1);
+    message_journal_flush();
+    restart_and_check();
+    CHECK(replayed_count == 36);
+}
+
+// Without a flush the buffered page is lost, everything flushed before survives
+static void test_reset_without_flush( void ) {
+    reset();
+
+    for (int i = 0; i < 20; i++) {
+        append();
+    }
+    message_journal_flush();
+    for (int i = 0; i < 5; i++) {
+        append();
+    }
+
+    for (int i = 20; i < 25; i++) {
+        messages[i].live = false;
+    }
+    restart_and_check();
+    CHECK(replayed_count == 20);
+}
+
+// Acks every message 60 appends after it was queued, or a few earlier now and
+// then, except for every 97th which is acked 900 appends later so that it is
+// still live when its sector is compacted. Restarts now and then
+static void test_rollover_and_compaction( void ) {
+    reset();
+    relocation_count = 0;
+
+    for (int i = 0; i < 3000; i++) {
+        uint32_t header = append();
+
+        if (header % 5 == 0 && header >= 45 && (header - 45) % 97 != 0) {
+            remove_message(header - 45);
+        }
+        if (header >= 60 && (header - 60) % 97 != 0 && messages[header - 60].live) {
+            remove_message(header - 60);
+        }
+        if (header >= 900 && (header - 900) % 97 == 0) {
+            remove_message(header - 900);
+        }
+
+        if (next_header == MAX_MESSAGES) {
+            // Start the headers over, the journal doesn't care
+            message_journal_flush();
+            restart_and_check();
+            for (int j = 0; j < MAX_MESSAGES; j++) {
+                if (messages[j].live) {
+                    remove_message(j);
+                }
+            }
+            message_journal_flush();
+            restart_and_check();
+            CHECK(replayed_count == 0);
+            next_header = 0;
+        }
+
+        if (i % 250 == 0) {
+            message_journal_flush();
+            restart_and_check();
+        }
+    }
+
+    // Several times around the ring, moving the long lived messages along
+    CHECK(erase_count > 3 * SECTOR_COUNT);
+    CHECK(relocation_count > 0);
+    message_journal_flush();
+    restart_and_check();
+    CHECK(replayed_count == live_count());
+}
+
+// Fills sectors 0 to 2 with every 25th record of sector 0 still live and cuts
+// the power writes_left writes into the append that starts sector 3, which
+// copies those records forward and erases sector 0
+static void cut_power_during_compaction( int writes_left ) {
+    reset();
+
+    for (int i = 0; i < SLOTS_PER_SECTOR - 1; i++) {
+        append();
+        if (i % 25 != 0) {
+            remove_message(i);
+        }
+    }
+    for (int i = 0; i < 2 * (SLOTS_PER_SECTOR - 1); i++) {
+        remove_message(append());
+    }
+    message_journal_flush();
+    uint32_t erases = erase_count;
+
+    // Sector header, the copied records and the erase
+    writes_until_power_cut = writes_left;
+    append();
+    CHECK(erase_count == erases + (writes_left > 2 ? 1 : 0));
+
+    // Still buffered when the power went
+    messages[next_header - 1].live = false;
+    restart_and_check();
+    CHECK(replayed_count == (SLOTS_PER_SECTOR - 1 + 24) / 25);
+}
+
+static void test_interrupted_compaction( void ) {
+    // Before the sector header, before the copies, before the erase of the
+    // compacted sector, then with the power left on
+    for (int writes_left = 0; writes_left <= 3; writes_left++) {
+        cut_power_during_compaction(writes_left);
+
+        // And the journal carries on from there
+        for (int i = 0; i < 20; i++) {
+            append();
+        }
+        message_journal_flush();
+        restart_and_check();
+    }
+}
+
+// A compacted sector whose records are all still live fills the fresh sector
+static void test_full_journal( void ) {
+    int unjournaled = 0;
+
+    reset();
+
+    for (int i = 0; i < MAX_MESSAGES; i++) {
+        CHECK(append() == (uint32_t) i);
+        if (messages[i].slot == MESSAGE_JOURNAL_NO_SLOT) {
+            unjournaled++;
+            // The application keeps it in RAM only, it won't come back
+            messages[i].live = false;
+        }
+    }
+    CHECK(unjournaled > 0);
+
+    // Relocations dropped the records that didn't fit from flash too
+    for (int i = 0; i < MAX_MESSAGES; i++) {
+        if (messages[i].live && messages[i].slot == MESSAGE_JOURNAL_NO_SLOT) {
+            messages[i].live = false;
+        }
+    }
+
+    message_journal_flush();
+    restart_and_check();
+    CHECK(replayed_count <= SECTOR_COUNT * (SLOTS_PER_SECTOR - 1));
+}
+
+int main( void ) {
+    test_append_and_replay();
+    test_tombstones();
+    test_reset_without_flush();
+    test_rollover_and_compaction();
+    test_interrupted_compaction();
+    test_full_journal();
+
+    printf("message journal: all tests passed\n");
+
+    return 0;
+}
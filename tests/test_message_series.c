@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Series codec: random series round trip exactly, including gaps across
+ * midnight and the end of the week, a message that doesn't fit leaves the
+ * encoder untouched, and a truncated series never decodes past its end.
+ */
+
+#include <string.h>
+
+#include "message_series.h"
+
+#include "host.h"
+
+#define SECONDS_PER_DAY 86400
+#define SECONDS_PER_WEEK (7 * SECONDS_PER_DAY)
+
+struct test_message {
+    uint32_t timestamp;
+    uint8_t content[MESSAGE_SERIES_MAX_COLUMNS];
+};
+
+static uint32_t random_state = 2023;
+
+static uint32_t random_next( void ) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return random_state;
+}
+
+static uint32_t to_timestamp( uint32_t seconds ) {
+    seconds %= SECONDS_PER_WEEK;
+
+    return ((seconds / SECONDS_PER_DAY) << 17) | (seconds % SECONDS_PER_DAY);
+}
+
+// A series that mixes steady and irregular gaps and small and large changes
+static void random_series( struct test_message* messages, int count, uint8_t columns ) {
+    uint32_t seconds = random_next() % SECONDS_PER_WEEK;
+    uint32_t gap = random_next() % 600;
+
+    for (int i = 0; i < count; i++) {
+        switch (random_next() % 6) {
+            case 0: gap += random_next() % 64; break;
+            case 1: gap = random_next() % 4000; break;
+            case 2: gap = random_next() % (SECONDS_PER_WEEK / 2); break;
+            default: break;
+        }
+        if (i > 0) {
+            seconds += gap;
+        }
+        messages[i].timestamp = to_timestamp(seconds);
+
+        for (int j = 0; j < columns; j++) {
+            uint8_t previous = i > 0 ? messages[i - 1].content[j] : random_next();
+
+            switch (random_next() % 4) {
+                case 0: messages[i].content[j] = previous; break;
+                case 1: messages[i].content[j] = previous + (int) (random_next() % 8) - 4; break;
+                case 2: messages[i].content[j] = random_next(); break;
+                default: messages[i].content[j] = previous + 1; break;
+            }
+        }
+    }
+}
+
+// Encodes as much of the series as fits in capacity and checks that it decodes
+// to the same messages. Returns how many fit
+static int round_trip( const struct test_message* messages, int count, uint8_t columns, uint8_t capacity ) {
+    uint8_t buffer[MESSAGE_SERIES_MAX_LENGTH + 4];
+    struct message_series_encoder encoder;
+    struct message_series_decoder decoder;
+    int encoded = 1;
+
+    memset(buffer, 0xAA, sizeof(buffer));
+    if (!message_series_encoder_init(&encoder, buffer, capacity, messages[0].timestamp, messages[0].content, columns)) {
+        CHECK(1 + columns > (capacity & ~0x03));
+        return 0;
+    }
+    while (encoded < count && message_series_encoder_append(&encoder, messages[encoded].timestamp, messages[encoded].content)) {
+        encoded++;
+    }
+
+    uint8_t length = message_series_encoder_length(&encoder);
+    CHECK(length % 4 == 0);
+    CHECK(length <= capacity && length <= MESSAGE_SERIES_MAX_LENGTH);
+    CHECK(encoded <= MESSAGE_SERIES_MAX_COUNT);
+    // Nothing written past the capacity it was given
+    for (int i = capacity < MESSAGE_SERIES_MAX_LENGTH ? capacity : MESSAGE_SERIES_MAX_LENGTH; i < (int) sizeof(buffer); i++) {
+        CHECK(buffer[i] == 0xAA);
+    }
+
+    uint32_t timestamp;
+    uint8_t content[MESSAGE_SERIES_MAX_COLUMNS];
+    uint8_t content_length;
+    int decoded = 0;
+
+    CHECK(message_series_decoder_init(&decoder, buffer, length, messages[0].timestamp));
+    while (message_series_decoder_next(&decoder, &timestamp, content, &content_length)) {
+        CHECK(decoded < encoded);
+        CHECK(timestamp == messages[decoded].timestamp);
+        CHECK(content_length == columns);
+        CHECK(memcmp(content, messages[decoded].content, columns) == 0);
+        decoded++;
+    }
+    CHECK(decoded == encoded);
+
+    return encoded;
+}
+
+static void test_round_trip( void ) {
+    struct test_message messages[MESSAGE_SERIES_MAX_COUNT + 8];
+    int total = 0;
+
+    for (int i = 0; i < 20000; i++) {
+        uint8_t columns = 1 + random_next() % MESSAGE_SERIES_MAX_COLUMNS;
+        uint8_t capacity = 4 + random_next() % (MESSAGE_SERIES_MAX_LENGTH + 8);
+
+        random_series(messages, MESSAGE_SERIES_MAX_COUNT + 8, columns);
+        total += round_trip(messages, MESSAGE_SERIES_MAX_COUNT + 8, columns, capacity);
+    }
+    CHECK(total > 20000);
+}
+
+static void test_steady_series( void ) {
+    struct test_message messages[MESSAGE_SERIES_MAX_COUNT + 1];
+
+    // Same gap and content every time: one bit for the time and one per column,
+    // so a full series of 3 byte messages fits in 4 + 31 * 4 bits
+    for (int i = 0; i < MESSAGE_SERIES_MAX_COUNT + 1; i++) {
+        messages[i].timestamp = to_timestamp(SECONDS_PER_WEEK - 3600 + i * 180);
+        messages[i].content[0] = 1;
+        messages[i].content[1] = 2;
+        messages[i].content[2] = 3;
+    }
+    // The first gap is a change from 0
+    messages[0].timestamp = to_timestamp(SECONDS_PER_WEEK - 3600 - 180);
+
+    CHECK(round_trip(messages, MESSAGE_SERIES_MAX_COUNT + 1, 3, MESSAGE_SERIES_MAX_LENGTH) == MESSAGE_SERIES_MAX_COUNT);
+}
+
+static void test_failed_append_leaves_encoder( void ) {
+    struct test_message messages[MESSAGE_SERIES_MAX_COUNT];
+    uint8_t buffer[MESSAGE_SERIES_MAX_LENGTH];
+    struct message_series_encoder encoder;
+
+    for (int i = 0; i < 1000; i++) {
+        uint8_t columns = 1 + random_next() % MESSAGE_SERIES_MAX_COLUMNS;
+        int appended = 1;
+
+        random_series(messages, MESSAGE_SERIES_MAX_COUNT, columns);
+        if (!message_series_encoder_init(&encoder, buffer, 8 + random_next() % 24, messages[0].timestamp, messages[0].content, columns)) {
+            continue;
+        }
+
+        while (appended < MESSAGE_SERIES_MAX_COUNT) {
+            struct message_series_encoder before = encoder;
+            uint8_t buffer_before[MESSAGE_SERIES_MAX_LENGTH];
+            memcpy(buffer_before, buffer, sizeof(buffer));
+
+            if (!message_series_encoder_append(&encoder, messages[appended].timestamp, messages[appended].content)) {
+                CHECK(memcmp(&before, &encoder, sizeof(encoder)) == 0);
+                CHECK(memcmp(buffer_before, buffer, sizeof(buffer)) == 0);
+                break;
+            }
+            appended++;
+        }
+    }
+}
+
+static void test_limits( void ) {
+    uint8_t buffer[MESSAGE_SERIES_MAX_LENGTH];
+    uint8_t content[MESSAGE_SERIES_MAX_COLUMNS + 1] = { 0 };
+    struct message_series_encoder encoder;
+    struct message_series_decoder decoder;
+
+    CHECK(!message_series_encoder_init(&encoder, buffer, sizeof(buffer), 0, content, 0));
+    CHECK(!message_series_encoder_init(&encoder, buffer, sizeof(buffer), 0, content, MESSAGE_SERIES_MAX_COLUMNS + 1));
+    // 1 + 7 bytes don't fit in 7, which is rounded down to 4
+    CHECK(!message_series_encoder_init(&encoder, buffer, 7, 0, content, 7));
+    CHECK(message_series_encoder_init(&encoder, buffer, 8, 0, content, 7));
+
+    // Empty and short buffers
+    CHECK(!message_series_decoder_init(&decoder, buffer, 0, 0));
+    buffer[0] = 0;
+    CHECK(!message_series_decoder_init(&decoder, buffer, 4, 0));
+    buffer[0] = 7 << 5;
+    CHECK(!message_series_decoder_init(&decoder, buffer, 4, 0));
+}
+
+// Cutting a series short must end the decode early, never read past the length
+static void test_truncated( void ) {
+    struct test_message messages[MESSAGE_SERIES_MAX_COUNT];
+    uint8_t buffer[MESSAGE_SERIES_MAX_LENGTH];
+    struct message_series_encoder encoder;
+    struct message_series_decoder decoder;
+
+    for (int i = 0; i < 1000; i++) {
+        uint8_t columns = 1 + random_next() % MESSAGE_SERIES_MAX_COLUMNS;
+        int encoded = 1;
+
+        random_series(messages, MESSAGE_SERIES_MAX_COUNT, columns);
+        CHECK(message_series_encoder_init(&encoder, buffer, sizeof(buffer), messages[0].timestamp, messages[0].content, columns));
+        while (encoded < MESSAGE_SERIES_MAX_COUNT && message_series_encoder_append(&encoder, messages[encoded].timestamp, messages[encoded].content)) {
+            encoded++;
+        }
+
+        uint8_t length = message_series_encoder_length(&encoder);
+        uint8_t truncated = 1 + columns + random_next() % (length - columns - 1);
+
+        uint32_t timestamp;
+        uint8_t content[MESSAGE_SERIES_MAX_COLUMNS];
+        uint8_t content_length;
+        int decoded = 0;
+
+        CHECK(message_series_decoder_init(&decoder, buffer, truncated, messages[0].timestamp));
+        while (message_series_decoder_next(&decoder, &timestamp, content, &content_length)) {
+            // Whatever comes out before the cut is right
+            CHECK(timestamp == messages[decoded].timestamp);
+            CHECK(memcmp(content, messages[decoded].content, columns) == 0);
+            decoded++;
+        }
+        CHECK(decoded <= encoded);
+        CHECK(!message_series_decoder_next(&decoder, &timestamp, content, &content_length));
+    }
+}
+
+int main( void ) {
+    test_round_trip();
+    test_steady_series();
+    test_failed_append_leaves_encoder();
+    test_limits();
+    test_truncated();
+
+    printf("message series: all tests passed\n");
+
+    return 0;
+}
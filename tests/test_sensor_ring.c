@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Sensor ring under load, with a producer and a consumer thread standing in for
+ * core1 and core0. Each record carries a sequence number and its complement, so
+ * a record that is read before it was completely written, read twice or skipped
+ * shows up.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#define main temperature_led_main
+#include "../src/temperature_led/main.c"
+#undef main
+
+#include "host.h"
+
+#define RECORD_COUNT 500000
+
+static bool producer_retries;
+static volatile uint32_t pushed;
+
+static void encode_sequence( uint32_t sequence, uint8_t* content ) {
+    content[0] = sequence >> 24;
+    content[1] = sequence >> 16;
+    content[2] = sequence >> 8;
+    content[3] = sequence;
+    content[4] = ~content[1];
+    content[5] = ~content[2];
+    content[6] = ~content[3];
+}
+
+static uint32_t decode_sequence( const struct sensor_record* record ) {
+    const uint8_t* content = &record->content[0];
+
+    CHECK(record->content_length == 7);
+    CHECK(record->f_port == (content[3] & 0x0F) + 1);
+    CHECK(record->type == (content[3] >> 4));
+    CHECK(record->priority == content[3] % MESSAGE_PRIORITY_COUNT);
+    CHECK(record->guaranteed_delivery == (content[3] & 1));
+    CHECK(content[4] == (uint8_t) ~content[1] && content[5] == (uint8_t) ~content[2] && content[6] == (uint8_t) ~content[3]);
+
+    return (content[0] << 24) | (content[1] << 16) | (content[2] << 8) | content[3];
+}
+
+static void* producer( void* argument ) {
+    uint8_t content[7];
+    uint32_t sequence = 0;
+
+    for (int i = 0; i < RECORD_COUNT; i++) {
+        encode_sequence(sequence, content);
+
+        // Give the consumer a go when the ring is full, the host may have a
+        // single CPU
+        while (!sensor_ring_push((sequence & 0x0F) + 1, (sequence & 0xFF) % MESSAGE_PRIORITY_COUNT, sequence & 1,
+                (sequence >> 4) & 0x0F, content, sizeof(content))) {
+            if (!producer_retries) {
+                break;
+            }
+            sched_yield();
+        }
+
+        // Without retries a dropped sequence number is simply never seen
+        sequence++;
+        pushed = i + 1;
+    }
+
+    return NULL;
+}
+
+// Returns the number of records received
+static uint32_t run( bool retries ) {
+    pthread_t thread;
+    struct sensor_record record;
+    uint32_t received = 0;
+    int64_t last_sequence = -1;
+
+    sensor_ring_head = 0;
+    sensor_ring_tail = 0;
+    sensor_ring_dropped = 0;
+    sensor_ring_high_water = 0;
+    producer_retries = retries;
+    pushed = 0;
+
+    CHECK(pthread_create(&thread, NULL, producer, NULL) == 0);
+
+    while (1) {
+        // Read before popping, so that an empty ring after the producer is done
+        // really means there's nothing left
+        bool done = pushed == RECORD_COUNT;
+
+        if (!sensor_ring_pop(&record)) {
+            if (done) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+
+        uint32_t sequence = decode_sequence(&record);
+        if (retries) {
+            CHECK(sequence == last_sequence + 1);
+        } else {
+            CHECK(sequence > last_sequence);
+        }
+        last_sequence = sequence;
+        received++;
+    }
+
+    CHECK(pthread_join(thread, NULL) == 0);
+    CHECK(sensor_ring_head == sensor_ring_tail);
+    CHECK(sensor_ring_high_water <= SENSOR_RING_SIZE);
+
+    return received;
+}
+
+int main( void ) {
+    sync_time(true);
+
+    // A producer that waits for room never loses a record
+    uint32_t received = run(true);
+    CHECK(received == RECORD_COUNT);
+    printf("sensor ring: %d records, high water %d\n", received, sensor_ring_high_water);
+
+    // One that doesn't loses exactly the records it was told it dropped
+    received = run(false);
+    CHECK(received > 0);
+    CHECK(received + sensor_ring_dropped == RECORD_COUNT);
+    printf("sensor ring: %d records, %d dropped, high water %d\n", received, sensor_ring_dropped, sensor_ring_high_water);
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2023 Todd Buiten.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * The main loop sleeps until the next deadline, but a door edge in the middle of
+ * that sleep wakes it up and goes out right away. In dual core mode core1 pushes
+ * the door record into the sensor ring, in single core mode the GPIO IRQ captures
+ * the edge and core0 samples the door once it has settled. Either way the record
+ * has to reach the server well before the deadline the loop went to sleep for.
+ */
+
+#define main temperature_led_main
+#include "../src/temperature_led/main.c"
+#undef main
+
+#include "host.h"
+
+#define DOOR_PORT 1
+#define DOOR_TYPE 2
+#define EDGE_DELAY_US 3000000
+
+static uint64_t door_received_us = 0;
+
+static void on_record( uint8_t f_port, uint32_t header, const uint8_t* content, uint8_t content_length ) {
+    if (f_port == DOOR_PORT && ((header >> 4) & 0x0F) == DOOR_TYPE && door_received_us == 0) {
+        door_received_us = host_time_us;
+    }
+}
+
+// What core1 and the GPIO IRQ would do when the door opens
+static void door_opens( void ) {
+#if DUAL_CORE_MODE
+    uint8_t door_open = 1;
+
+    sensor_ring_push(DOOR_PORT, MESSAGE_PRIORITY_ALARM, true, DOOR_TYPE, &door_open, 1);
+#else
+    host_gpio_level[0] = !host_gpio_level[0];
+    capture_gpio_irqs(0, GPIO_IRQ_EDGE_RISE);
+#endif
+}
+
+// One pass of the service_messages() loop, up to its sleep
+static void service_step( void ) {
+    int task;
+    while ((task = pop_due_task(get_us_since_boot())) >= 0) {
+        run_task(task);
+    }
+
+#if DUAL_CORE_MODE
+    drain_sensor_ring();
+#else
+    uint64_t sensor_time = service_sensors();
+    if (sensor_time != UINT64_MAX) {
+        schedule_task(TASK_SENSORS, sensor_time);
+    }
+#endif
+
+    transfer_data_step();
+}
+
+int main( void ) {
+    init_message_queue();
+    host_network_reset(1);
+    host_network.on_record = on_record;
+
+#if !DUAL_CORE_MODE
+    setup_interrupts();
+#endif
+    join();
+    sync_time(true);
+    schedule_task(TASK_DAILY_TASKS, get_us_since_boot() + DAILY_TASK_TIMEOUT_US);
+    schedule_task(TASK_TIME_RESYNC, get_us_since_boot() + TIME_RESYNC_TIMEOUT_US);
+
+    // Let the first sensor samples and uplinks go out, until the loop would sleep
+    // for a while
+    for (int i = 0; i < 100 && next_task_due_time() <= get_us_since_boot() + 2 * EDGE_DELAY_US; i++) {
+        service_step();
+        wait_for_next_event();
+    }
+    service_step();
+
+    uint64_t sleep_start = host_time_us;
+    uint64_t deadline = next_task_due_time() - BOOT_TIME_OFFSET_US;
+    CHECK(deadline > sleep_start + 2 * EDGE_DELAY_US);
+
+    host_interrupt_time_us = sleep_start + EDGE_DELAY_US;
+    host_interrupt = door_opens;
+
+    for (int i = 0; i < 100 && door_received_us == 0; i++) {
+        wait_for_next_event();
+        service_step();
+    }
+
+    CHECK(door_received_us != 0);
+    CHECK(door_received_us < deadline);
+#if DUAL_CORE_MODE
+    // Sent in the same wakeup
+    CHECK(door_received_us == sleep_start + EDGE_DELAY_US);
+#else
+    // Sent as soon as the door has settled
+    CHECK(door_received_us <= sleep_start + EDGE_DELAY_US + DOOR_SETTLE_US + 1000);
+#endif
+
+    printf("door edge %.1f s into a %.1f s sleep, received after %.3f s\n",
+        EDGE_DELAY_US / 1e6, (deadline - sleep_start) / 1e6, (door_received_us - sleep_start - EDGE_DELAY_US) / 1e6);
+
+    return 0;
+}